@@ -563,7 +563,9 @@ raw_ostream &CWriter::printType(raw_ostream &Out, Type *Ty,
             Out << temp_str << " " << ptrName;
             return Out;
     } else {
-        if (isKernel) Out << "global ";
+        // __attribute__((address_space(3))) in the GPU source is __local
+        if (PTy->getAddressSpace() == 3) Out << "local ";
+        else if (isKernel) Out << "global ";
         return printType(Out, PTy->getElementType(), false, ptrName);
     }
   }
@@ -2263,6 +2265,7 @@ void CWriter::printFunctionSignature(const Function *F, bool Prototype) {
       N == "get_local_size" ||
       N == "get_num_groups" ||
       N == "get_work_dim" ||
+      N == "barrier" ||
       N == "cos" ||
       N == "fabs" ||
       N == "sin" ||
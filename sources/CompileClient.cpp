@@ -0,0 +1,54 @@
+
+
+
+#include "compiler/CompileProtocol.h"
+
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <limits.h>
+#include <unistd.h>
+
+extern char** environ;
+
+
+/// Send the compile to the server at CPP_OPENCL_SERVER, which is started
+/// with 'cpp_opencl --serve <socket>'. Without a server the compile is run
+/// by cpp_opencl itself.
+int main(int Argc, const char **Argv)
+{
+    const char* SocketPath = std::getenv("CPP_OPENCL_SERVER");
+    int Connection = SocketPath ? compiler::protocol::Connect(SocketPath) : -1;
+    if (Connection < 0) {
+        std::vector<const char*> Args(Argv, Argv + Argc);
+        Args[0] = "cpp_opencl";
+        Args.push_back(nullptr);
+        ::execvp(Args[0], const_cast<char* const*>(Args.data()));
+        std::perror("cpp_opencl");
+        return 1;
+    }
+
+    char WorkingDir[PATH_MAX];
+    if (!::getcwd(WorkingDir, sizeof(WorkingDir))) {
+        std::perror("cpp_opencl_client");
+        return 1;
+    }
+    std::vector<std::string> Environment;
+    for (char** Variable = environ; *Variable; ++Variable)
+        Environment.push_back(*Variable);
+
+    std::vector<std::string> Reply;
+    if (!compiler::protocol::WriteMessage(Connection, {WorkingDir}) ||
+        !compiler::protocol::WriteMessage(Connection, std::vector<std::string>(Argv, Argv + Argc)) ||
+        !compiler::protocol::WriteMessage(Connection, Environment) ||
+        !compiler::protocol::ReadMessage(Connection, Reply) || Reply.size() != 2) {
+        std::cerr << "cpp_opencl_client: lost the connection to " << SocketPath << "\n";
+        return 1;
+    }
+    ::close(Connection);
+
+    std::cerr << Reply[1];
+    return std::atoi(Reply[0].c_str());
+}
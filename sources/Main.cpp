@@ -3,11 +3,20 @@
 
 #include "compiler/MainEntry.h"
 #include "compiler/Compiler.h"
+#include "compiler/CompileServer.h"
+
+#include <cstdlib>
+#include <string>
+#include <thread>
 
 
 int main(int Argc, const char **Argv)
 {
-    compiler::MainEntry(Argc, Argv, compiler::BuildClCode);
+    // cpp_opencl --serve <socket> [workers]
+    if (Argc > 2 && std::string(Argv[1]) == "--serve") {
+        unsigned Workers = Argc > 3 ? std::atoi(Argv[3]) : std::thread::hardware_concurrency();
+        return compiler::ServeCompiles(Argv[0], Argv[2], Workers);
+    }
 
-    return 0;
+    return compiler::MainEntry(Argc, Argv, compiler::BuildClCode);
 }
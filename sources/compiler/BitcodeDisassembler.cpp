@@ -2,6 +2,7 @@
 
 #include "../sources/CBackend/CTargetMachine.h"
 
+#include <llvm/ADT/OwningPtr.h>
 #include <llvm/IR/LLVMContext.h>
 #include <llvm/ADT/Triple.h>
 #include <llvm/Assembly/PrintModulePass.h>
@@ -27,6 +28,7 @@
 #include <llvm/Target/TargetMachine.h>
 
 #include <memory>
+#include <mutex>
 #include <stdexcept>
 
 #include <llvm/IRReader/IRReader.h>
@@ -56,9 +58,10 @@ public:
     /// Return the disassembled bitcode as source-code e.g. CL source
     std::string DisassembleModule();
 
+    static void InitializeTargets();
+    static void InitializePasses();
+
 protected:
-    virtual void InitializeTargets();
-    virtual void InitializePasses();
     virtual void CreateTargetOptions();
     virtual void CreateTriple();
     virtual void CreateTargetMachine();
@@ -68,7 +71,8 @@ protected:
 
     llvm::Module* TheModule;
     llvm::Triple TheTriple;
-    TargetMachine* TheTargetMachine;
+    // Destroyed after the pass manager, whose passes refer to it
+    llvm::OwningPtr<TargetMachine> TheTargetMachine;
     llvm::TargetOptions TheTargetOptions;
     llvm::PassManager ThePassMgr;
 };
@@ -148,9 +152,9 @@ void BitcodeDisassemblerImpl::CreateTargetMachine()
 
     CodeGenOpt::Level OLvl = CodeGenOpt::Default; // Determine optimization level
 
-    TheTargetMachine = TheTarget->createTargetMachine(
+    TheTargetMachine.reset(TheTarget->createTargetMachine(
                 TheTriple.getTriple(), MCPU, FeaturesStr,
-                TheTargetOptions, RelocModel, CMModel, OLvl);
+                TheTargetOptions, RelocModel, CMModel, OLvl));
     assert(TheTargetMachine && "Could not allocate target machine!");
 
     if (DisableDotLoc)
@@ -205,7 +209,9 @@ std::string BitcodeDisassemblerImpl::RunPass()
     formatted_raw_ostream FOS{B};
     AnalysisID StartAfterID = 0;
     AnalysisID StopAfterID = 0;
-    cl::opt<bool> NoVerify("disable-verify", cl::Hidden, cl::desc("Do not verify input module"));
+    // Not a cl::opt: registering an option is not thread-safe, and one
+    // created here would never be parsed anyway
+    const bool NoVerify = false;
     if (TheTargetMachine->addPassesToEmitFile(ThePassMgr, FOS, FileType, NoVerify, StartAfterID, StopAfterID)) {
         errs() <<  ": target does not support generation of this"
                << " file type!\n";
@@ -222,15 +228,13 @@ std::string BitcodeDisassemblerImpl::RunPass()
 std::string BitcodeDisassemblerImpl::DisassembleModule()
 {
     assert(TheModule!=nullptr);
-static bool count = true;
-if (count) {
-    InitializeTargets();
-    InitializePasses();
+
+    // Every module gets a target machine of its own, so that modules can be
+    // disassembled on several threads at once
+    BitcodeDisassembler::Initialize();
     CreateTriple();
     CreateTargetOptions();
     CreateTargetMachine();
-    count = false;
-}
     return RunPass();
 }
 
@@ -243,6 +247,15 @@ BitcodeDisassembler::~BitcodeDisassembler()
 {
 }
 
+void BitcodeDisassembler::Initialize()
+{
+    static std::once_flag Registered;
+    std::call_once(Registered, []() {
+        BitcodeDisassemblerImpl::InitializeTargets();
+        BitcodeDisassemblerImpl::InitializePasses();
+    });
+}
+
 std::string BitcodeDisassembler::DisassembleModule()
 {
     std::string Output = TheDisassembler->DisassembleModule();
@@ -28,6 +28,10 @@ public:
     /// Return the disassembled bitcode as source-code e.g. CL source
     std::string DisassembleModule();
 
+    /// Register the targets and passes once per process. Done on the first
+    /// DisassembleModule, or earlier by a process that forks compiles.
+    static void Initialize();
+
 protected:
     std::shared_ptr<BitcodeDisassemblerImpl> TheDisassembler;
 };
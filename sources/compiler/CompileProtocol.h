@@ -0,0 +1,118 @@
+#ifndef COMPILEPROTOCOL_H
+#define COMPILEPROTOCOL_H
+
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+namespace compiler {
+
+
+/// The messages exchanged with the compile server over its Unix socket.
+/// A message is a list of strings: their count, then the length and bytes
+/// of each. The client sends three messages: its working directory, the
+/// command line and its environment. The server answers with one: the exit
+/// status and everything the compile wrote to stdout and stderr.
+///
+/// Header-only and without LLVM, so that the client stays small.
+namespace protocol {
+
+
+inline bool WriteAll(int Fd, const void* Data, ::size_t Length)
+{
+    const char* Bytes = static_cast<const char*>(Data);
+    while (Length > 0) {
+        ssize_t Written = ::write(Fd, Bytes, Length);
+        if (Written < 0 && errno == EINTR)
+            continue;
+        if (Written <= 0)
+            return false;
+        Bytes += Written;
+        Length -= Written;
+    }
+    return true;
+}
+
+inline bool ReadAll(int Fd, void* Data, ::size_t Length)
+{
+    char* Bytes = static_cast<char*>(Data);
+    while (Length > 0) {
+        ssize_t Read = ::read(Fd, Bytes, Length);
+        if (Read < 0 && errno == EINTR)
+            continue;
+        if (Read <= 0)
+            return false;
+        Bytes += Read;
+        Length -= Read;
+    }
+    return true;
+}
+
+inline bool WriteMessage(int Fd, const std::vector<std::string>& Strings)
+{
+    uint32_t Count = Strings.size();
+    if (!WriteAll(Fd, &Count, sizeof(Count)))
+        return false;
+    for (const std::string& S : Strings) {
+        uint32_t Length = S.size();
+        if (!WriteAll(Fd, &Length, sizeof(Length)) || !WriteAll(Fd, S.data(), S.size()))
+            return false;
+    }
+    return true;
+}
+
+inline bool ReadMessage(int Fd, std::vector<std::string>& Strings)
+{
+    uint32_t Count = 0;
+    if (!ReadAll(Fd, &Count, sizeof(Count)))
+        return false;
+    Strings.clear();
+    for (uint32_t i = 0; i < Count; ++i) {
+        uint32_t Length = 0;
+        if (!ReadAll(Fd, &Length, sizeof(Length)))
+            return false;
+        std::string S(Length, '\0');
+        if (Length > 0 && !ReadAll(Fd, &S[0], Length))
+            return false;
+        Strings.push_back(S);
+    }
+    return true;
+}
+
+inline bool MakeAddress(const std::string& SocketPath, sockaddr_un& Address)
+{
+    std::memset(&Address, 0, sizeof(Address));
+    Address.sun_family = AF_UNIX;
+    if (SocketPath.size() >= sizeof(Address.sun_path))
+        return false;
+    std::strcpy(Address.sun_path, SocketPath.c_str());
+    return true;
+}
+
+/// A connection to the server listening on 'SocketPath', or -1
+inline int Connect(const std::string& SocketPath)
+{
+    sockaddr_un Address;
+    if (!MakeAddress(SocketPath, Address))
+        return -1;
+    int Fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+    if (Fd < 0)
+        return -1;
+    if (::connect(Fd, reinterpret_cast<sockaddr*>(&Address), sizeof(Address)) != 0) {
+        ::close(Fd);
+        return -1;
+    }
+    return Fd;
+}
+
+
+} // namespace protocol
+} // namespace compiler
+
+#endif
@@ -0,0 +1,170 @@
+#include "CompileServer.h"
+#include "CompileProtocol.h"
+#include "Compiler.h"
+#include "MainEntry.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <set>
+#include <string>
+#include <vector>
+
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+
+namespace {
+
+
+// How often finished workers are reaped while waiting for clients
+static const int PollInterval = 50;
+
+// How long, in seconds, a worker waits for a client to take its reply
+static const int ReplyTimeout = 60;
+
+/// Run the compile sent on 'Connection' in this, the compile process
+int RunCompile(const char* Argv0, int Connection, int Output)
+{
+    ::dup2(Output, STDOUT_FILENO);
+    ::dup2(Output, STDERR_FILENO);
+
+    std::vector<std::string> WorkingDir, Args, Environment;
+    if (!compiler::protocol::ReadMessage(Connection, WorkingDir) ||
+        !compiler::protocol::ReadMessage(Connection, Args) ||
+        !compiler::protocol::ReadMessage(Connection, Environment) ||
+        WorkingDir.size() != 1 || Args.empty()) {
+        std::cerr << "cpp_opencl: malformed compile request\n";
+        return 1;
+    }
+    if (::chdir(WorkingDir[0].c_str()) != 0) {
+        std::perror(WorkingDir[0].c_str());
+        return 1;
+    }
+    ::clearenv();
+    for (std::string& Variable : Environment)
+        ::putenv(&Variable[0]);
+
+    // The driver finds the compiler's headers relative to the executable,
+    // which is the server and not the client
+    Args[0] = Argv0;
+    std::vector<const char*> Argv;
+    for (const std::string& Arg : Args)
+        Argv.push_back(Arg.c_str());
+    return compiler::MainEntry(Argv.size(), Argv.data(), compiler::BuildClCode);
+}
+
+/// Serve the client on 'Connection' in this, the worker process. The
+/// compile runs in a process of its own, so that its output can be sent
+/// even if it crashes, and the reply is sent from here, so that a client
+/// that does not read it holds up only its own worker.
+int ServeClient(const char* Argv0, int Connection)
+{
+    FILE* Output = std::tmpfile();
+    pid_t Compile = Output ? ::fork() : -1;
+    if (Compile == 0) {
+        int Code = RunCompile(Argv0, Connection, ::fileno(Output));
+        std::fflush(nullptr);
+        ::_exit(Code);
+    }
+    int Status = 0;
+    if (Compile < 0 || ::waitpid(Compile, &Status, 0) != Compile) {
+        compiler::protocol::WriteMessage(Connection, {"1", "cpp_opencl: cannot start a compile\n"});
+        return 1;
+    }
+
+    int Code = WIFEXITED(Status) ? WEXITSTATUS(Status) : 128 + WTERMSIG(Status);
+    std::string Text;
+    std::rewind(Output);
+    char Buffer[4096];
+    while (::size_t Read = std::fread(Buffer, 1, sizeof(Buffer), Output))
+        Text.append(Buffer, Read);
+    timeval Timeout {ReplyTimeout, 0};
+    ::setsockopt(Connection, SOL_SOCKET, SO_SNDTIMEO, &Timeout, sizeof(Timeout));
+    return compiler::protocol::WriteMessage(Connection, {std::to_string(Code), Text}) ? 0 : 1;
+}
+
+/// Is the peer of 'Connection' run by the user running the server ?
+bool IsSameUser(int Connection)
+{
+    ucred Peer;
+    socklen_t Length = sizeof(Peer);
+    return ::getsockopt(Connection, SOL_SOCKET, SO_PEERCRED, &Peer, &Length) == 0 &&
+           Peer.uid == ::getuid();
+}
+
+
+} // namespace
+
+
+namespace compiler {
+
+
+int ServeCompiles(const char* Argv0, const std::string& SocketPath, unsigned WorkerCount)
+{
+    sockaddr_un Address;
+    if (!protocol::MakeAddress(SocketPath, Address)) {
+        std::cerr << "cpp_opencl: socket path is too long: " << SocketPath << "\n";
+        return 1;
+    }
+
+    // A socket left behind by a server that was killed is replaced
+    ::unlink(SocketPath.c_str());
+    int Listener = ::socket(AF_UNIX, SOCK_STREAM, 0);
+    if (Listener < 0 ||
+        ::bind(Listener, reinterpret_cast<sockaddr*>(&Address), sizeof(Address)) != 0 ||
+        ::listen(Listener, SOMAXCONN) != 0) {
+        std::perror(SocketPath.c_str());
+        return 1;
+    }
+
+    // A client that goes away must not take the server with it
+    ::signal(SIGPIPE, SIG_IGN);
+
+    // Done once here, and inherited by every worker
+    InitializeCompiler();
+
+    WorkerCount = std::max(WorkerCount, 1u);
+    std::set<pid_t> Running;
+    for (;;) {
+        // Reap the finished workers, waiting for one if all of them are busy
+        pid_t Finished;
+        while (!Running.empty() &&
+               (Finished = ::waitpid(-1, nullptr, Running.size() >= WorkerCount ? 0 : WNOHANG)) > 0)
+            Running.erase(Finished);
+
+        pollfd Poll {Listener, POLLIN, 0};
+        if (Running.size() >= WorkerCount || ::poll(&Poll, 1, Running.empty() ? -1 : PollInterval) <= 0)
+            continue;
+        int Connection = ::accept(Listener, nullptr, nullptr);
+        if (Connection < 0)
+            continue;
+
+        // Compiles run with the server's rights, so only its user may ask
+        if (!IsSameUser(Connection)) {
+            protocol::WriteMessage(Connection, {"1", "cpp_opencl: the server belongs to another user\n"});
+            ::close(Connection);
+            continue;
+        }
+
+        pid_t Worker = ::fork();
+        if (Worker == 0) {
+            ::close(Listener);
+            ::_exit(ServeClient(Argv0, Connection));
+        }
+        if (Worker < 0)
+            protocol::WriteMessage(Connection, {"1", "cpp_opencl: cannot start a compile\n"});
+        else
+            Running.insert(Worker);
+        ::close(Connection);
+    }
+}
+
+
+} // namespace compiler
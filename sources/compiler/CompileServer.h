@@ -0,0 +1,21 @@
+#ifndef COMPILESERVER_H
+#define COMPILESERVER_H
+
+#include <string>
+
+namespace compiler {
+
+
+/// Serve compiles sent by cpp_opencl_client on the Unix socket
+/// 'SocketPath'. Targets and passes are registered once, and every compile
+/// runs in a process forked from the server, in the client's working
+/// directory and environment. At most 'WorkerCount' compiles run at a time.
+///
+/// Returns an exit status if the socket cannot be served; otherwise it
+/// serves until the process is killed.
+int ServeCompiles(const char* Argv0, const std::string& SocketPath, unsigned WorkerCount);
+
+
+} // namespace compiler
+
+#endif
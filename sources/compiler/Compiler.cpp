@@ -2,16 +2,24 @@
 #include "Compiler.h"
 #include "BitcodeDisassembler.h"
 #include "Rewriter.h"
+#include "CompilerCache.h"
 
 #include <memory>
 #include <vector>
+#include <map>
 #include <set>
 #include <ctime>
 #include <cstdio>
+#include <cstdlib>
 #include <fstream>
+#include <exception>
+#include <future>
+#include <mutex>
 
+#include <clang/CodeGen/BackendUtil.h>
 #include <clang/CodeGen/CodeGenAction.h>
 #include <clang/Lex/Preprocessor.h>
+#include <clang/Lex/PreprocessorOptions.h>
 #include <clang/Basic/TargetInfo.h>
 #include <clang/Driver/DriverDiagnostic.h>
 #include <clang/Driver/Options.h>
@@ -20,16 +28,22 @@
 #include <clang/Frontend/FrontendDiagnostic.h>
 #include <clang/Frontend/TextDiagnosticBuffer.h>
 #include <clang/Frontend/TextDiagnosticPrinter.h>
+#include <clang/Frontend/Utils.h>
 #include <clang/FrontendTool/Utils.h>
 #include <llvm/ADT/Statistic.h>
+#include <llvm/IR/Constants.h>
+#include <llvm/IR/GlobalVariable.h>
+#include <llvm/IR/Module.h>
 #include <llvm/LinkAllPasses.h>
 #include <llvm/Support/ErrorHandling.h>
 #include <llvm/Support/ManagedStatic.h>
 #include <llvm/Support/Signals.h>
+#include <llvm/Support/Threading.h>
 #include <llvm/Support/TargetSelect.h>
 #include <llvm/Support/Timer.h>
 #include <llvm/Support/raw_ostream.h>
 #include <llvm/Support/Host.h>
+#include <llvm/Support/MemoryBuffer.h>
 #include <llvm/Target/TargetOptions.h>
 
 
@@ -42,13 +56,16 @@ using namespace llvm::opt;
 namespace {
 
 
+// The diagnostics of the compile running on this thread
+thread_local DiagnosticsEngine* ThreadDiagnostics = nullptr;
 
 static void LLVMErrorHandler(void *UserData, const std::string &Message,
                              bool GenCrashDiag)
 {
-    DiagnosticsEngine& Diags = *static_cast<DiagnosticsEngine*>(UserData);
-
-    Diags.Report(diag::err_fe_error_backend) << Message;
+    if (ThreadDiagnostics)
+        ThreadDiagnostics->Report(diag::err_fe_error_backend) << Message;
+    else
+        llvm::errs() << Message << "\n";
 
     // Run the interrupt handlers to make sure any special cleanups get done, in
     // particular that we remove files registered with RemoveFileOnSignal.
@@ -126,11 +143,13 @@ void CreateTarget(OwningPtr<CompilerInstance>& Clang)
     Clang->setTarget(clang::TargetInfo::CreateTargetInfo(Clang->getDiagnostics(), TO));
 }
 
-void CreateFileManager(OwningPtr<CompilerInstance>& Clang)
+void CreateFileManager(OwningPtr<CompilerInstance>& Clang, FileManager* FileMgr)
 {
-    Clang->createFileManager();
-    FileManager& FileMgr = Clang->getFileManager();
-    Clang->createSourceManager(FileMgr);
+    if (FileMgr)
+        Clang->setFileManager(FileMgr);
+    else
+        Clang->createFileManager();
+    Clang->createSourceManager(Clang->getFileManager());
 }
 
 void CreatePreprocessor(OwningPtr<CompilerInstance>& Clang)
@@ -153,13 +172,25 @@ void CreateMainFile(OwningPtr<CompilerInstance>& Clang, const char* SourceFileNa
 
 void InstallFatalErrorHandler(OwningPtr<CompilerInstance>& Clang)
 {
-    llvm::remove_fatal_error_handler();
     // Set an error handler, so that any LLVM backend diagnostics go through our
-    // error handler.
-    llvm::install_fatal_error_handler(LLVMErrorHandler,
-                                    static_cast<void*>(&Clang->getDiagnostics()));
+    // error handler. There is one handler per process, installed once, which
+    // reports to the diagnostics of the compile on the failing thread.
+    static std::once_flag Installed;
+    std::call_once(Installed, []() {
+        llvm::remove_fatal_error_handler();
+        llvm::install_fatal_error_handler(LLVMErrorHandler, nullptr);
+    });
+    ThreadDiagnostics = &Clang->getDiagnostics();
 }
 
+/// Clears ThreadDiagnostics when it goes out of scope. Declared before the
+/// compiler instance, so that a later error on the thread is not reported to
+/// the diagnostics of an instance that no longer exists.
+struct ThreadDiagnosticsGuard
+{
+    ~ThreadDiagnosticsGuard() { ThreadDiagnostics = nullptr; }
+};
+
 std::string GetSourceFileName(SmallVector<const char*, 256>& Args)
 {
     SmallVector<const char*, 256>::const_iterator it =
@@ -168,24 +199,83 @@ std::string GetSourceFileName(SmallVector<const char*, 256>& Args)
     else return Args[Args.size()-1];
 }
 
-OwningPtr<CompilerInstance> CreateCompilerInstance(SmallVector<const char*, 256>& Args, DiagnosticConsumer* DiagsBuffer)
+std::string GetOutputFileName(SmallVector<const char*, 256>& Args)
+{
+    SmallVector<const char*, 256>::const_iterator it =
+            find_if(begin(Args), end(Args), [](const char* s) { return string(s) == string("-o"); } );
+    if (it!=end(Args) && it+1!=end(Args)) return *++it;
+    else return "";
+}
+
+/// 'FileMgr', if given, is shared with other compiler instances, so that
+/// the files and directories it has already looked up are not looked up on
+/// disk again. 'Source', if given, is compiled from memory in place of the
+/// contents of the source file.
+OwningPtr<CompilerInstance> CreateCompilerInstance(SmallVector<const char*, 256>& Args, DiagnosticConsumer* DiagsBuffer,
+                                                   FileManager* FileMgr = nullptr,
+                                                   const llvm::MemoryBuffer* Source = nullptr)
 {
     OwningPtr<CompilerInstance> Clang { CreateCompilerInvocation(Args, DiagsBuffer) };
+    if (Source) {
+        // The preprocessors created for the instance and for its action both
+        // remap the file, so the buffer is kept by the caller
+        PreprocessorOptions& PPOpts = Clang->getPreprocessorOpts();
+        PPOpts.addRemappedFile(GetSourceFileName(Args), Source);
+        PPOpts.RetainRemappedFileBuffers = true;
+    }
     InstallFatalErrorHandler(Clang);
     CreateTarget(Clang);
-    CreateFileManager(Clang);
+    CreateFileManager(Clang, FileMgr);
     CreatePreprocessor(Clang);
     CreateAST(Clang);
     CreateMainFile(Clang, GetSourceFileName(Args).c_str());
     return Clang;
 }
 
-void CompileCpuSourceFile(SmallVector<const char*, 256>& Args, std::string SourceCode)
+/// The rewritten sources are compiled from memory. They are written next
+/// to the source file only if CPP_OPENCL_SAVE_TEMPS is set, for debugging.
+void SaveTemporaryFile(const std::string& FileName, const std::string& SourceCode)
+{
+    if (!std::getenv("CPP_OPENCL_SAVE_TEMPS"))
+        return;
+    std::ofstream File{ FileName };
+    File << SourceCode;
+}
+
+/// The backend action and output file extension of the frontend action of
+/// 'Clang'. Returns false if the frontend action does not generate code.
+bool GetBackendAction(OwningPtr<CompilerInstance>& Clang, BackendAction& Action, std::string& Extension)
+{
+    switch (Clang->getFrontendOpts().ProgramAction) {
+    case frontend::EmitObj: Action = Backend_EmitObj; Extension = "o"; return true;
+    case frontend::EmitAssembly: Action = Backend_EmitAssembly; Extension = "s"; return true;
+    case frontend::EmitBC: Action = Backend_EmitBC; Extension = "bc"; return true;
+    case frontend::EmitLLVM: Action = Backend_EmitLL; Extension = "ll"; return true;
+    default: return false;
+    }
+}
+
+/// Define the array that the rewritten CPU source declares for its OpenCL
+/// source, which is registered with the runtime when the program starts
+void EmbedOpenCLSource(llvm::Module& M, const std::string& OpenCLSource)
+{
+    llvm::GlobalVariable* Declaration = M.getGlobalVariable(compiler::EmbeddedSourceSymbol);
+    llvm::Constant* Data = llvm::ConstantDataArray::getString(M.getContext(), OpenCLSource);
+    llvm::GlobalVariable* Definition = new llvm::GlobalVariable(M, Data->getType(), true,
+                                                                llvm::GlobalValue::InternalLinkage, Data);
+    Declaration->replaceAllUsesWith(llvm::ConstantExpr::getBitCast(Definition, Declaration->getType()));
+    Definition->takeName(Declaration);
+    Declaration->eraseFromParent();
+}
+
+/// The object embeds the OpenCL source, so code generation waits for the GPU
+/// compile. The frontend, which takes most of the time, runs alongside it.
+bool CompileCpuSourceFile(SmallVector<const char*, 256>& Args, const std::string& SourceCode, FileManager* FileMgr,
+                          std::shared_future<std::string> OpenCLSource)
 {
     std::string CpuFileName { GetSourceFileName(Args) + "_cpu.cpp" };
-    std::ofstream cpu_file{ CpuFileName };
-    cpu_file << SourceCode;
-    cpu_file.close();
+    SaveTemporaryFile(CpuFileName, SourceCode);
+    OwningPtr<llvm::MemoryBuffer> Source { llvm::MemoryBuffer::getMemBuffer(SourceCode, CpuFileName) };
 
     SmallVector<const char*, 256> ArgsCpu {Args};
     SmallVector<const char*, 256>::iterator it =
@@ -193,21 +283,53 @@ void CompileCpuSourceFile(SmallVector<const char*, 256>& Args, std::string Sourc
     if (it!=end(ArgsCpu)) *++it = CpuFileName.c_str();
     else ArgsCpu[ArgsCpu.size()-1] = CpuFileName.c_str();
 
-    OwningPtr<CompilerInstance> Clang { CreateCompilerInstance(ArgsCpu, new TextDiagnosticBuffer) };
+    ThreadDiagnosticsGuard Guard;
+    OwningPtr<CompilerInstance> Clang { CreateCompilerInstance(ArgsCpu, new TextDiagnosticBuffer, FileMgr, Source.get()) };
+
+    BackendAction Action;
+    std::string Extension;
+    if (!GetBackendAction(Clang, Action, Extension))
+        return ExecuteCompilerInvocation(Clang.get());
+
+    // Generate the module without optimizing it, as it is optimized with the
+    // code generation below
+    CodeGenOptions& CodeGenOpts = Clang->getCodeGenOpts();
+    bool DisableLLVMOpts = CodeGenOpts.DisableLLVMOpts;
+    CodeGenOpts.DisableLLVMOpts = true;
+    OwningPtr<clang::CodeGenAction> Act(new clang::EmitLLVMOnlyAction());
+    bool Success = Clang->ExecuteAction(*Act);
+    CodeGenOpts.DisableLLVMOpts = DisableLLVMOpts;
+    if (!Success)
+        return false;
+
+    OwningPtr<llvm::Module> TheModule { Act->takeModule() };
+    if (TheModule->getGlobalVariable(compiler::EmbeddedSourceSymbol)) {
+        std::string OpenCL = OpenCLSource.get();
+        if (OpenCL.empty())
+            return false;
+        EmbedOpenCLSource(*TheModule, OpenCL);
+    }
 
-    ExecuteCompilerInvocation(Clang.get());
+    raw_ostream* Out = Clang->createDefaultOutputFile(Action != Backend_EmitAssembly && Action != Backend_EmitLL,
+                                                      CpuFileName, Extension);
+    if (!Out)
+        return false;
+    EmitBackendOutput(Clang->getDiagnostics(), CodeGenOpts, Clang->getTargetOpts(), Clang->getLangOpts(),
+                      TheModule.get(), Action, Out);
+    Clang->clearOutputFiles(Clang->getDiagnostics().hasErrorOccurred());
+    Success = !Clang->getDiagnostics().hasErrorOccurred();
 
     // If any timers were active but haven't been destroyed yet, print their
     // results now.  This happens in -disable-free mode.
     llvm::TimerGroup::printAll(llvm::errs());
+    return Success;
 }
 
-std::string CompileGpuSourceFile(SmallVector<const char*, 256>& Args, std::string SourceCode)
+std::string CompileGpuSourceFile(SmallVector<const char*, 256>& Args, const std::string& SourceCode, FileManager* FileMgr)
 {
     std::string GpuFileName { GetSourceFileName(Args) + "_gpu.cpp" };
-    std::ofstream gpu_file{ GpuFileName };
-    gpu_file << SourceCode;
-    gpu_file.close();
+    SaveTemporaryFile(GpuFileName, SourceCode);
+    OwningPtr<llvm::MemoryBuffer> Source { llvm::MemoryBuffer::getMemBuffer(SourceCode, GpuFileName) };
 
     SmallVector<const char*, 256> ArgsGpu {Args};
     SmallVector<const char*, 256>::iterator it2 =
@@ -215,7 +337,8 @@ std::string CompileGpuSourceFile(SmallVector<const char*, 256>& Args, std::strin
     if (it2!=end(ArgsGpu)) *++it2 = GpuFileName.c_str();
     else ArgsGpu[ArgsGpu.size()-1] = GpuFileName.c_str();
 
-    OwningPtr<CompilerInstance> Clang { CreateCompilerInstance(ArgsGpu, new TextDiagnosticBuffer) };
+    ThreadDiagnosticsGuard Guard;
+    OwningPtr<CompilerInstance> Clang { CreateCompilerInstance(ArgsGpu, new TextDiagnosticBuffer, FileMgr, Source.get()) };
 
     OwningPtr<clang::CodeGenAction> Act(new clang::EmitLLVMOnlyAction());
     if (!Clang->ExecuteAction(*Act)) {
@@ -240,15 +363,14 @@ std::string CompileGpuSourceFile(SmallVector<const char*, 256>& Args, std::strin
     return OpenCLSource;
 }
 
-
-}  // namespace
-
-namespace compiler {
-
-
-std::vector<std::string> RewriteSourceFile(SmallVector<const char*, 256>& Args)
+/// Rewrite the source file into the CPU and GPU sources. 'FileMgr' is set
+/// to the file manager of the compiler instance, for use by the compiles of
+/// the rewritten sources.
+std::vector<std::string> RewriteSource(SmallVector<const char*, 256>& Args, IntrusiveRefCntPtr<FileManager>& FileMgr)
 {
-    OwningPtr<CompilerInstance> Clang { CreateCompilerInstance(Args, nullptr) };
+    ThreadDiagnosticsGuard Guard;
+    OwningPtr<CompilerInstance> Clang { CreateCompilerInstance(Args, nullptr, FileMgr.getPtr()) };
+    FileMgr = &Clang->getFileManager();
 
     compiler::RewriterASTConsumer* TheConsumer = new compiler::RewriterASTConsumer {Clang};
     Preprocessor &PP = Clang->getPreprocessor();
@@ -258,18 +380,108 @@ std::vector<std::string> RewriteSourceFile(SmallVector<const char*, 256>& Args)
     return {TheConsumer->GetRewritenCpuSource(), TheConsumer->GetRewritenGpuSource()};
 }
 
-std::vector<std::string> BuildClCode(SmallVector<const char*, 256>& Args)
+/// The source file after preprocessing, which identifies it together with
+/// the arguments in the compiler cache. 'FileMgr' is set like by
+/// RewriteSource.
+std::string PreprocessSource(SmallVector<const char*, 256>& Args, IntrusiveRefCntPtr<FileManager>& FileMgr)
 {
-    InitializeTargets();
+    ThreadDiagnosticsGuard Guard;
+    OwningPtr<CompilerInstance> Clang { CreateCompilerInstance(Args, nullptr, FileMgr.getPtr()) };
+    FileMgr = &Clang->getFileManager();
+
+    std::string Preprocessed;
+    llvm::raw_string_ostream Out{ Preprocessed };
+    PreprocessorOutputOptions Opts = Clang->getPreprocessorOutputOpts();
+    Opts.ShowCPP = 1;
+    DoPrintPreprocessedInput(Clang->getPreprocessor(), &Out, Opts);
+    Out.flush();
+    return Preprocessed;
+}
 
-    auto Sources = RewriteSourceFile(Args);
+/// Generate the object file and the OpenCL source. Returns false if either
+/// compile failed.
+bool CompileSource(SmallVector<const char*, 256>& Args, IntrusiveRefCntPtr<FileManager>& FileMgr)
+{
+    // The rewritten CPU source includes the same headers as the source file,
+    // which the shared file manager has already found
+    auto Sources = RewriteSource(Args, FileMgr);
     assert(Sources.size() == 2);
-    CompileCpuSourceFile(Args, Sources[0]);
-    CompileGpuSourceFile(Args, Sources[1]);
+
+    // The two compiles each have a compiler instance and an LLVMContext of
+    // their own, and run at the same time until the CPU compile needs the
+    // OpenCL source. The file manager is not thread-safe, so the GPU compile
+    // creates its own.
+    std::promise<std::string> OpenCLSource;
+    std::shared_future<std::string> Embedded = OpenCLSource.get_future().share();
+    auto Cpu = std::async(std::launch::async, [&Args, &Sources, &FileMgr, Embedded]() {
+        return CompileCpuSourceFile(Args, Sources[0], FileMgr.getPtr(), Embedded);
+    });
+    // The CPU compile waits for the OpenCL source, so it gets one even if
+    // the GPU compile throws; an empty source fails it
+    std::string OpenCL;
+    try {
+        OpenCL = CompileGpuSourceFile(Args, Sources[1], nullptr);
+    } catch(std::exception& e) {
+        llvm::errs() << "error: " << e.what() << "\n";
+    } catch(...) {
+        OpenCLSource.set_exception(std::current_exception());
+        throw;
+    }
+    OpenCLSource.set_value(OpenCL);
+    return Cpu.get() && !OpenCL.empty();
+}
+
+
+}  // namespace
+
+namespace compiler {
+
+
+void InitializeCompiler()
+{
+    InitializeTargets();
+    BitcodeDisassembler::Initialize();
+    llvm::llvm_start_multithreaded();
+}
+
+std::vector<std::string> RewriteSourceFile(SmallVector<const char*, 256>& Args)
+{
+    IntrusiveRefCntPtr<FileManager> FileMgr;
+    return RewriteSource(Args, FileMgr);
+}
+
+int BuildClCode(SmallVector<const char*, 256>& Args)
+{
+    InitializeCompiler();
+
+    // The files a compile generates, by their names in the compiler cache
+    std::string SourceFileName { GetSourceFileName(Args) };
+    std::map<std::string, std::string> Outputs {
+        {"object", GetOutputFileName(Args)},
+        {"cl", SourceFileName + ".cl"}
+    };
+    if (std::getenv("CPP_OPENCL_SAVE_TEMPS")) {
+        Outputs["cpu.cpp"] = SourceFileName + "_cpu.cpp";
+        Outputs["gpu.cpp"] = SourceFileName + "_gpu.cpp";
+    }
+
+    // The preprocessed source is hashed before anything is rewritten, and on
+    // a hit the outputs are copied from the cache instead
+    CompilerCache Cache;
+    IntrusiveRefCntPtr<FileManager> FileMgr;
+    if (Cache.IsEnabled() && !Outputs["object"].empty())
+        Cache.SetKey(PreprocessSource(Args, FileMgr), std::vector<std::string>(Args.begin(), Args.end()));
+
+    bool Success = Cache.Restore(Outputs);
+    if (!Success) {
+        Success = CompileSource(Args, FileMgr);
+        if (Success)
+            Cache.Store(Outputs);
+    }
 
     llvm::llvm_shutdown();
 
-    return {};
+    return Success ? 0 : 1;
 }
 
 } // namespace compiler
@@ -7,8 +7,13 @@
 
 namespace compiler {
 
+/// Register targets and passes. BuildClCode does this itself; a server
+/// calls it once before forking compiles, so that they need not.
+void InitializeCompiler();
 std::vector<std::string> RewriteSourceFile(clang::SmallVector<const char*, 256>& Args);
-std::vector<std::string> BuildClCode(clang::SmallVector<const char*, 256>& Args);
+/// Generate the object file and the OpenCL source. Returns 0 if they were
+/// generated, and 1 otherwise.
+int BuildClCode(clang::SmallVector<const char*, 256>& Args);
 
 
 }
@@ -0,0 +1,242 @@
+#include "CompilerCache.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <climits>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+
+#include <dirent.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <utime.h>
+
+#include <clang/Basic/Version.h>
+#include <llvm/ADT/SmallString.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/MD5.h>
+
+
+namespace {
+
+
+// Changed whenever the generated files change for the same input, so that
+// older entries are no longer used
+static const char CacheFormat[] = "cpp_opencl-cache-1";
+
+/// The build of the running executable: its size and modification time,
+/// which change whenever cpp_opencl is rebuilt. Rewriter changes do not
+/// change the clang version, and hashing the whole executable on every
+/// compile would cost more than a cache hit saves.
+std::string GetToolIdentity(const std::string& Argv0)
+{
+    // This just needs to be some symbol in the binary
+    void* MainAddr = (void*) (intptr_t) GetToolIdentity;
+    std::string Path = llvm::sys::fs::getMainExecutable(Argv0.c_str(), MainAddr);
+    struct stat Info;
+    if (Path.empty() || stat(Path.c_str(), &Info) != 0)
+        return Path;
+    return std::to_string(Info.st_size) + ":" + std::to_string(Info.st_mtime);
+}
+
+bool CopyFile(const std::string& From, const std::string& To)
+{
+    std::ifstream In(From, std::ios::binary);
+    if (In.fail())
+        return false;
+    std::ofstream Out(To, std::ios::binary);
+    Out << In.rdbuf();
+    Out.close();
+    return !Out.fail();
+}
+
+std::vector<std::string> ListDirectory(const std::string& Dir)
+{
+    std::vector<std::string> Names;
+    if (DIR* D = opendir(Dir.c_str())) {
+        while (dirent* Entry = readdir(D)) {
+            std::string Name = Entry->d_name;
+            if (Name != "." && Name != "..")
+                Names.push_back(Name);
+        }
+        closedir(D);
+    }
+    return Names;
+}
+
+void RemoveDirectory(const std::string& Dir)
+{
+    for (const std::string& Name : ListDirectory(Dir))
+        std::remove((Dir + "/" + Name).c_str());
+    rmdir(Dir.c_str());
+}
+
+
+} // namespace
+
+
+namespace compiler {
+
+
+CompilerCache::CompilerCache() :
+    MaxSize{DefaultMaxSize}
+{
+    if (const char* CacheDir = std::getenv("CPP_OPENCL_COMPILER_CACHE"))
+        Dir = CacheDir;
+    const char* Size = std::getenv("CPP_OPENCL_COMPILER_CACHE_SIZE");
+    if (Size && !ParseSize(Size, MaxSize))
+        std::cerr << "cpp_opencl: warning: ignoring CPP_OPENCL_COMPILER_CACHE_SIZE=" << Size
+                  << ", which is not a size such as 500M or 2G\n";
+}
+
+bool CompilerCache::IsEnabled() const
+{
+    return !Dir.empty();
+}
+
+bool CompilerCache::ParseSize(const char* Size, unsigned long long& Bytes)
+{
+    // strtoull would accept leading blanks and a sign
+    if (!std::isdigit(static_cast<unsigned char>(*Size)))
+        return false;
+    char* End = nullptr;
+    errno = 0;
+    unsigned long long Value = std::strtoull(Size, &End, 10);
+    if (errno == ERANGE)
+        return false;
+
+    static const std::string Units = "KMG";
+    if (*End) {
+        std::string::size_type Unit = Units.find(std::toupper(static_cast<unsigned char>(*End)));
+        if (Unit == std::string::npos || End[1] || Value > ULLONG_MAX >> 10 * (Unit + 1))
+            return false;
+        Value <<= 10 * (Unit + 1);
+    }
+    Bytes = Value;
+    return true;
+}
+
+void CompilerCache::SetKey(const std::string& PreprocessedSource, const std::vector<std::string>& Args)
+{
+    llvm::MD5 Hash;
+    Hash.update(CacheFormat);
+    Hash.update(clang::getClangFullVersion());
+    Hash.update(GetToolIdentity(Args.empty() ? std::string() : Args[0]));
+    char WorkingDir[PATH_MAX];
+    if (getcwd(WorkingDir, sizeof(WorkingDir)))
+        Hash.update(WorkingDir);
+    Hash.update(llvm::StringRef("", 1));
+    for (unsigned int i = 0; i < Args.size(); ++i) {
+        if (Args[i] == "-o") {
+            ++i;
+            continue;
+        }
+        // Separated, so that "-a" "b" and "-ab" differ
+        Hash.update(Args[i]);
+        Hash.update(llvm::StringRef("", 1));
+    }
+    Hash.update(PreprocessedSource);
+
+    llvm::MD5::MD5Result Result;
+    Hash.final(Result);
+    llvm::SmallString<32> Hex;
+    llvm::MD5::stringifyResult(Result, Hex);
+    Key = Hex.str().str();
+}
+
+std::string CompilerCache::GetEntryDir() const
+{
+    return Dir + "/" + Key;
+}
+
+bool CompilerCache::Restore(const std::map<std::string, std::string>& Files)
+{
+    if (!IsEnabled() || Key.empty())
+        return false;
+
+    std::string EntryDir = GetEntryDir();
+    for (const auto& File : Files) {
+        if (access((EntryDir + "/" + File.first).c_str(), R_OK) != 0)
+            return false;
+    }
+    for (const auto& File : Files) {
+        if (!CopyFile(EntryDir + "/" + File.first, File.second))
+            return false;
+    }
+
+    // The modification time of an entry is the time it was last used
+    utime(EntryDir.c_str(), nullptr);
+    return true;
+}
+
+void CompilerCache::Store(const std::map<std::string, std::string>& Files)
+{
+    if (!IsEnabled() || Key.empty())
+        return;
+
+    // Write to a temporary directory first so that concurrent compiles
+    // never restore a partially written entry
+    mkdir(Dir.c_str(), 0755);
+    std::string EntryDir = GetEntryDir();
+    std::string TempDir = EntryDir + "." + std::to_string(getpid());
+    if (mkdir(TempDir.c_str(), 0755) != 0)
+        return;
+    for (const auto& File : Files) {
+        if (access(File.second.c_str(), R_OK) == 0 && !CopyFile(File.second, TempDir + "/" + File.first)) {
+            RemoveDirectory(TempDir);
+            return;
+        }
+    }
+
+    RemoveDirectory(EntryDir);
+    if (std::rename(TempDir.c_str(), EntryDir.c_str()) != 0)
+        RemoveDirectory(TempDir);
+    Evict();
+}
+
+void CompilerCache::Evict()
+{
+    struct Entry
+    {
+        std::string Name;
+        time_t LastUse;
+        unsigned long long Size;
+    };
+
+    std::vector<Entry> Entries;
+    unsigned long long TotalSize = 0;
+    for (const std::string& Name : ListDirectory(Dir)) {
+        // Entries still being written by other compiles are left alone
+        if (Name.find('.') != std::string::npos)
+            continue;
+        struct stat Info;
+        if (stat((Dir + "/" + Name).c_str(), &Info) != 0 || !S_ISDIR(Info.st_mode))
+            continue;
+
+        Entry E {Name, Info.st_mtime, 0};
+        for (const std::string& File : ListDirectory(Dir + "/" + Name)) {
+            if (stat((Dir + "/" + Name + "/" + File).c_str(), &Info) == 0)
+                E.Size += Info.st_size;
+        }
+        TotalSize += E.Size;
+        Entries.push_back(E);
+    }
+
+    std::sort(Entries.begin(), Entries.end(), [](const Entry& A, const Entry& B) {
+        return A.LastUse < B.LastUse;
+    });
+    for (const Entry& E : Entries) {
+        if (TotalSize <= MaxSize)
+            break;
+        RemoveDirectory(Dir + "/" + E.Name);
+        TotalSize -= E.Size;
+    }
+}
+
+
+} // namespace compiler
@@ -0,0 +1,64 @@
+#ifndef COMPILERCACHE_H
+#define COMPILERCACHE_H
+
+#include <map>
+#include <string>
+#include <vector>
+
+namespace compiler {
+
+
+/// A cache of the files generated for a source file, so that compiling an
+/// unchanged file again only copies them. Entries are keyed by a hash of the
+/// preprocessed source, the compiler arguments and working directory, the
+/// clang version and the build of cpp_opencl itself.
+///
+/// The cache is enabled by setting CPP_OPENCL_COMPILER_CACHE to a directory.
+/// CPP_OPENCL_COMPILER_CACHE_SIZE limits its size, e.g. 500M or 2G (1G by
+/// default); the least recently used entries are evicted beyond it. A size
+/// that cannot be parsed is ignored with a warning.
+class CompilerCache
+{
+public:
+    static const unsigned long long DefaultMaxSize = 1ULL << 30;
+
+    CompilerCache(const CompilerCache& that) = delete;
+    CompilerCache& operator=(CompilerCache&) = delete;
+
+    CompilerCache();
+
+    bool IsEnabled() const;
+
+    /// Parse a size such as 1234, 500M or 2G into 'Bytes'. Returns false,
+    /// leaving 'Bytes' alone, if it is not a number with an optional unit.
+    static bool ParseSize(const char* Size, unsigned long long& Bytes);
+
+    /// Identify the entry of a compile. The value of -o is left out of the
+    /// key, since the outputs are copied to wherever they are wanted. The
+    /// working directory is part of it, as relative paths in the arguments
+    /// and the absolute name of the OpenCL source depend on it.
+    void SetKey(const std::string& PreprocessedSource, const std::vector<std::string>& Args);
+
+    /// The directory of the entry of the current key
+    std::string GetEntryDir() const;
+
+    /// Copy the files of the entry to their paths, given by their names in
+    /// the entry. Returns false if the entry is missing any of them.
+    bool Restore(const std::map<std::string, std::string>& Files);
+
+    /// Replace the entry with the files that exist of 'Files', then evict
+    /// entries until the cache fits its size limit
+    void Store(const std::map<std::string, std::string>& Files);
+
+private:
+    void Evict();
+
+    std::string Dir;
+    unsigned long long MaxSize;
+    std::string Key;
+};
+
+
+} // namespace compiler
+
+#endif
@@ -257,9 +257,9 @@ static void ParseProgName(SmallVectorImpl<const char *> &ArgVector,
 
 namespace compiler {
 
-std::vector<std::string> MainEntry(int Argc,
-                                   const char **Argv,
-                                   std::function<std::vector<std::string>(clang::SmallVector<const char*, 256>&)> Func)
+int MainEntry(int Argc,
+              const char **Argv,
+              std::function<int(clang::SmallVector<const char*, 256>&)> Func)
 {
     llvm::sys::PrintStackTraceOnErrorSignal();
     llvm::PrettyStackTraceProgram X(Argc, Argv);
@@ -275,7 +275,7 @@ std::vector<std::string> MainEntry(int Argc,
         if (Tool == "")
             return Func(argv);
         llvm::errs() << "error: unknown integrated tool '" << Tool << "'\n";
-        return {"",""};
+        return 1;
     }
 
     bool CanonicalPrefixes = true;
@@ -441,7 +441,7 @@ std::vector<std::string> MainEntry(int Argc,
         Res = 1;
 #endif
 
-    return {"",""};
+    return Res;
 }
 
 
@@ -9,9 +9,11 @@
 
 namespace compiler {
 
-std::vector<std::string> MainEntry(int Argc,
-                                   const char** Argv,
-                                   std::function<std::vector<std::string>(clang::SmallVector<const char*, 256>&)> F);
+/// Run the driver and call 'F' on the first cc1 job. Returns the exit
+/// status of 'F', or of the driver if it ran no job, e.g. for --version.
+int MainEntry(int Argc,
+              const char** Argv,
+              std::function<int(clang::SmallVector<const char*, 256>&)> F);
 
 }
 
@@ -1,23 +1,37 @@
 #include "Rewriter.h"
 
 #include <clang/AST/ASTContext.h>
+#include <clang/AST/DeclTemplate.h>
 #include <clang/Sema/Sema.h>
 #include <clang/Lex/Lexer.h>
 #include <clang/Frontend/CompilerInstance.h>
 #include <clang/Parse/ParseAST.h>
+#include <llvm/ADT/SmallString.h>
+#include <llvm/Support/FileSystem.h>
 
 using namespace clang;
 
 namespace compiler {
 
 
+/// The name the OpenCL source of the file at 'Loc' is registered and looked
+/// up under: the absolute path of the .cl file written next to it. Files of
+/// the same name in different directories get different names, and the
+/// program finds the .cl file from any working directory.
+static std::string GetOpenCLFileName(const SourceManager& SM, SourceLocation Loc)
+{
+    llvm::SmallString<256> Path { SM.getFilename(Loc) };
+    llvm::sys::fs::make_absolute(Path);
+    return Path.str().str() + ".cl";
+}
+
 void ParseAST(OwningPtr<CompilerInstance>& TheCompInst, RewriterASTConsumer& TheConsumer)
 {
     clang::ParseAST(TheCompInst->getPreprocessor(), &TheConsumer, TheCompInst->getASTContext());
 }
 
 RewriterASTConsumer::RewriterASTConsumer(const OwningPtr<CompilerInstance>& CI) :
-    RewritenCpuSource{}, RewritenGpuSource{}, ParallelForEachCallCount{0}
+    RewritenCpuSource{}, RewritenGpuSource{}, ParallelForEachCallCount{0}, HasIndexDeclarator{false}
 {
     TheCpuRewriter.setSourceMgr(CI->getSourceManager(), CI->getLangOpts());
     TheGpuRewriter.setSourceMgr(CI->getSourceManager(), CI->getLangOpts());
@@ -61,6 +75,17 @@ void RewriterASTConsumer::HandleTranslationUnit(ASTContext& Context)
     TranslationUnitDecl* D = Context.getTranslationUnitDecl();
     TraverseDecl(D);
 
+    // The OpenCL source is registered with the runtime when the program is
+    // loaded, by the name of the file it is also written to
+    if (ParallelForEachCallCount > 0) {
+        SourceManager& SM = TheCpuRewriter.getSourceMgr();
+        SourceLocation Eof = SM.getLocForEndOfFile(SM.getMainFileID());
+        std::string FileName { GetOpenCLFileName(SM, Eof) };
+        TheCpuRewriter.InsertTextAfter(Eof, std::string("\n\nextern \"C\" const char ") + EmbeddedSourceSymbol + "[];\n" +
+                                       "static compute::detail::EmbeddedSource cpp_opencl_embedded_source_registrar ( \"" +
+                                       FileName + "\" , " + EmbeddedSourceSymbol + " );\n");
+    }
+
     const RewriteBuffer& RewriteBufG =
             TheGpuRewriter.getEditBuffer(TheGpuRewriter.getSourceMgr().getMainFileID());
     RewritenGpuSource = std::string(RewriteBufG.begin(), RewriteBufG.end());
@@ -120,10 +145,58 @@ void RemoveStatement(clang::Rewriter& TheRewriter, clang::CallExpr const * const
     TheRewriter.RemoveText(SourceRange(Statement->getSourceRange()));
 }
 
+// The algorithms whose lambda is compiled into OpenCL kernels
+static bool IsComputeAlgorithm(const std::string& Name)
+{
+    return "compute::parallel_for_each" == Name ||
+           "compute::parallel_for" == Name ||
+           "compute::reduce" == Name ||
+           "compute::inclusive_scan" == Name ||
+           "compute::exclusive_scan" == Name;
+}
+
+// The qualified name of the function called by 'E', if it is a call
+static std::string GetCalleeName(clang::Expr const * const E)
+{
+    clang::CallExpr const * const Call = dyn_cast<clang::CallExpr>(const_cast<clang::Expr*>(E)->IgnoreImplicit());
+    if (!Call || !Call->getDirectCallee())
+        return "";
+    return Call->getDirectCallee()->getQualifiedNameAsString();
+}
+
+// Collect the compute::map calls of the pipeline 'E', first stage first.
+// Returns false if 'E' is not a chain of compute::map calls applied to
+// compute::pipeline.
+static bool GetPipelineStages(clang::Expr const * const E, std::vector<clang::CallExpr const *>& Stages)
+{
+    std::string Name = GetCalleeName(E);
+    if ("compute::pipeline" == Name)
+        return true;
+    if ("compute::detail::operator|" != Name)
+        return false;
+
+    clang::CallExpr const * const Call = cast<clang::CallExpr>(const_cast<clang::Expr*>(E)->IgnoreImplicit());
+    if (!GetPipelineStages(Call->getArg(0), Stages) || "compute::map" != GetCalleeName(Call->getArg(1)))
+        return false;
+    Stages.push_back(cast<clang::CallExpr>(const_cast<clang::Expr*>(Call->getArg(1))->IgnoreImplicit()));
+    return true;
+}
+
 bool RewriterASTConsumer::VisitCallExpr(clang::CallExpr const * const Statement)
 {
     if (clang::FunctionDecl const * const F = Statement->getDirectCallee()) {
-        if ("compute::parallel_for_each" != F->getQualifiedNameAsString())
+        // A whole pipeline, e.g.
+        // compute::pipeline(begin, end) | compute::map(f) | compute::map(g) | compute::into(output)
+        std::vector<clang::CallExpr const *> Stages;
+        if ("compute::detail::operator|" == F->getQualifiedNameAsString() && 2 == Statement->getNumArgs() &&
+                "compute::into" == GetCalleeName(Statement->getArg(1)) &&
+                GetPipelineStages(Statement->getArg(0), Stages) && !Stages.empty()) {
+            RemoveFunction(TheGpuRewriter, Func);
+            OnPipelineCall(Statement, Stages);
+            return true;
+        }
+
+        if (!IsComputeAlgorithm(F->getQualifiedNameAsString()))
             return true;
         //RemoveStatement(TheGpuRewriter, Statement);
         RemoveFunction(TheGpuRewriter, Func);
@@ -140,15 +213,49 @@ void RewriterASTConsumer::OnParallelForEachCall(clang::CallExpr const * const St
     Lambda.Rewrite(Statement);
 }
 
+void RewriterASTConsumer::OnPipelineCall(clang::CallExpr const * const Statement,
+                                         const std::vector<clang::CallExpr const *>& Stages)
+{
+    WriteGpuDeclarators(Statement);
+
+    std::vector<std::unique_ptr<LambdaRewiter>> Lambdas;
+    for (clang::CallExpr const * const Stage : Stages) {
+        Lambdas.emplace_back(new LambdaRewiter(TheCpuRewriter, TheGpuRewriter));
+        Lambdas.back()->Rewrite(Stage);
+    }
+
+    // One kernel for the whole pipeline, following the lambdas of its stages
+    SourceManager& SM = TheGpuRewriter.getSourceMgr();
+    std::pair<FileID, unsigned> locInfo = SM.getDecomposedLoc(Statement->getLocStart());
+    SourceLocation Eof = SM.getLocForEndOfFile(locInfo.first);
+    TheGpuRewriter.InsertTextAfter(Eof, LambdaRewiter::GetPipelineKernels(Lambdas));
+}
+
 void RewriterASTConsumer::WriteGpuDeclarators(clang::CallExpr const * const Statement)
 {
+    SourceManager& SM = TheGpuRewriter.getSourceMgr();
+    std::pair<FileID, unsigned> locInfo = SM.getDecomposedLoc(Statement->getLocStart());
+    SourceLocation Eof = SM.getLocForEndOfFile(locInfo.first);
+
     if (++ParallelForEachCallCount == 1) {
-        SourceManager& SM = TheGpuRewriter.getSourceMgr();
-        std::pair<FileID, unsigned> locInfo = SM.getDecomposedLoc(Statement->getLocStart());
-        SourceLocation Eof = SM.getLocForEndOfFile(locInfo.first);
         std::string Decls1 { "extern \"C\" long long get_global_id(int);" };
         std::string Decls2 { "extern \"C\" int get_global_size(int);" };
-        TheGpuRewriter.InsertTextAfter(Eof, Decls1 + "\n" + Decls2 + "\n\n\n");
+        std::string Decls3 { "extern \"C\" long long get_local_id(int);" };
+        std::string Decls4 { "extern \"C\" int get_local_size(int);" };
+        std::string Decls5 { "extern \"C\" long long get_group_id(int);" };
+        std::string Decls6 { "extern \"C\" void barrier(int) __attribute__((noduplicate));" };
+        TheGpuRewriter.InsertTextAfter(Eof, Decls1 + "\n" + Decls2 + "\n" + Decls3 + "\n" + Decls4 + "\n" +
+                                       Decls5 + "\n" + Decls6 + "\n\n\n");
+    }
+
+    // The lambdas of parallel_for take a compute::index<N>, which is defined
+    // in ParallelForEach.h like on the host
+    if (!HasIndexDeclarator &&
+            "compute::parallel_for" == Statement->getDirectCallee()->getQualifiedNameAsString()) {
+        HasIndexDeclarator = true;
+        std::string Index { "namespace compute { template <int N> struct index { long long Values[N]; "
+                    "long long operator[](int I) const { return Values[I]; } }; }" };
+        TheGpuRewriter.InsertTextAfter(Eof, Index + "\n\n\n");
     }
 }
 
@@ -160,12 +267,13 @@ namespace {
 
 LambdaRewiter::LambdaRewiter(Rewriter& CpuRewriter, Rewriter& GpuRewriter)
     : RecursiveASTVisitor<LambdaRewiter>(),
-      TheCpuRewriter(CpuRewriter), TheGpuRewriter(GpuRewriter)
+      TheCpuRewriter(CpuRewriter), TheGpuRewriter(GpuRewriter), TheRank{0}, HasHostCopy{true}
 {
 }
 
 void LambdaRewiter::Rewrite(CallExpr const * const Statement)
 {
+    TheAlgorithm = Statement->getDirectCallee()->getQualifiedNameAsString();
     ExtractLambdaFunctionInfo(Statement);
     GenerateKernelNamePostfix();
     RewriteGpuCode();
@@ -174,10 +282,15 @@ void LambdaRewiter::Rewrite(CallExpr const * const Statement)
 
 void LambdaRewiter::ExtractLambdaFunctionInfo(CallExpr const * const Statement)
 {
+    // The lambda is always last: e.g. begin, end, further inputs, output and
+    // the lambda for parallel_for_each, begin, end, init and the lambda for
+    // reduce, extent, output and the lambda for parallel_for, or the lambda
+    // alone for the compute::map stages of a pipeline
     FunctionDecl const * const F = Statement->getDirectCallee();
-    static const unsigned int NR_ARGUMENTS = 4;
-    assert(NR_ARGUMENTS == std::min(Statement->getNumArgs(), F->getNumParams()));
-    Stmt const * const S = Statement->getArg(NR_ARGUMENTS-1);
+    static const unsigned int MIN_NR_ARGUMENTS = 1;
+    unsigned int NrArguments = std::min(Statement->getNumArgs(), F->getNumParams());
+    assert(MIN_NR_ARGUMENTS <= NrArguments);
+    Stmt const * const S = Statement->getArg(NrArguments-1);
     this->TraverseStmt(const_cast<Stmt*>(S));
 }
 
@@ -187,14 +300,11 @@ bool LambdaRewiter::VisitLambdaExpr(LambdaExpr *LE)
     LambdaExpr::capture_iterator E = LE->capture_end();
     for (; I != E; ++I) {
         if (VarDecl* D = I->getCapturedVar()) {
-            std::string Type {QualType::getAsString(D->getType().split())};
-            std::string Variable {D->getName().str()};
-
             if (I->getCaptureKind() == LCK_ByRef) {
-                TheCapturesByRef.push_back({"",Type,Variable});
+                TheCapturesByRef.push_back(GetCaptureInfo(D));
             }
             else if (I->getCaptureKind() == LCK_ByCopy) {
-                TheCapturesByValue.push_back({"",Type,Variable});
+                TheCapturesByValue.push_back(GetCaptureInfo(D));
             }
             else {
                 return false;
@@ -202,6 +312,9 @@ bool LambdaRewiter::VisitLambdaExpr(LambdaExpr *LE)
         }
     }
 
+    // The element type of the output range
+    TheReturnType = QualType::getAsString(LE->getCallOperator()->getResultType().split());
+
     CaptureListRange.setBegin(LE->getIntroducerRange().getBegin());
     CaptureListRange.setEnd(LE->getIntroducerRange().getEnd());
     BodyRange.setBegin(LE->getBody()->getLocStart());
@@ -211,6 +324,24 @@ bool LambdaRewiter::VisitLambdaExpr(LambdaExpr *LE)
     return true;
 }
 
+LambdaRewiter::DeclarationInfo LambdaRewiter::GetCaptureInfo(VarDecl const * const D) const
+{
+    ASTContext& Context = D->getASTContext();
+    QualType Type = D->getType().getNonReferenceType().getUnqualifiedType();
+    std::string ValueType;
+
+    if (const ConstantArrayType* A = Context.getAsConstantArrayType(Type)) {
+        ValueType = QualType::getAsString(A->getElementType().getUnqualifiedType().split());
+    }
+    else if (const ClassTemplateSpecializationDecl* S =
+             dyn_cast_or_null<ClassTemplateSpecializationDecl>(Type->getAsCXXRecordDecl())) {
+        if ("vector" == S->getName() && StringRef(S->getQualifiedNameAsString()).startswith("std::"))
+            ValueType = QualType::getAsString(S->getTemplateArgs()[0].getAsType().split());
+    }
+
+    return {ValueType, QualType::getAsString(Type.split()), D->getName().str()};
+}
+
 bool LambdaRewiter::VisitDeclStmt(DeclStmt *S)
 {
     for (DeclStmt::decl_iterator I = S->decl_begin(),
@@ -230,6 +361,16 @@ bool LambdaRewiter::VisitVarDecl(VarDecl *VD)
     if (! VD->isLocalVarDecl()) {
         std::string VarTypeName {QualType::getAsString(VD->getType().split())};
         std::string VarName {VD->getName().str()};
+
+        // The compute::index<N> parameter of a parallel_for lambda
+        if (const ClassTemplateSpecializationDecl* S =
+                dyn_cast_or_null<ClassTemplateSpecializationDecl>(VD->getType()->getAsCXXRecordDecl())) {
+            if ("compute::index" == S->getQualifiedNameAsString()) {
+                TheRank = S->getTemplateArgs()[0].getAsIntegral().getZExtValue();
+                VarTypeName = "compute::index<" + std::to_string(TheRank) + ">";
+            }
+        }
+
         TheParams.push_back({"",VarTypeName,VarName});
     }
     return true;
@@ -240,33 +381,257 @@ void LambdaRewiter::GenerateKernelNamePostfix()
     PostfixName = std::string("_") + std::to_string(std::rand());
 }
 
+bool LambdaRewiter::VisitCallExpr(CallExpr *E)
+{
+    if (FunctionDecl const * const F = E->getDirectCallee()) {
+        HasRestrictAttribute Result{F};
+        if (Result.IsRestrict() && !Result.HasCPU())
+            HasHostCopy = false;
+    }
+    return true;
+}
+
 void LambdaRewiter::RewriteCpuCode()
 {
     SourceManager& SM = TheCpuRewriter.getSourceMgr();
-    std::string FileName { " \"" + std::string {SM.getFilename(BodyRange.getBegin())} +  ".cl\" " };
+    std::string FileName { " \"" + GetOpenCLFileName(SM, BodyRange.getBegin()) + "\" " };
     std::string KernelName {" \"_Kernel" + PostfixName + "\" "};
     std::string NewLambdaBody { " { return std::pair<std::string,std::string> ( " + FileName + "," + KernelName + "); }" };
+
+    // The captures are returned too, in the order of the kernel arguments
+    if (!TheCapturesByValue.empty() || !TheCapturesByRef.empty()) {
+        std::string Captures;
+        for (const DeclarationInfoList* List : {&TheCapturesByValue, &TheCapturesByRef}) {
+            for (const DeclarationInfo& Capture : *List)
+                Captures += ", compute::detail::Capture(" + Capture.VariableName + ")";
+        }
+        NewLambdaBody = " { return std::make_tuple( std::string(" + FileName + "), std::string(" + KernelName + ")" +
+                Captures + "); }";
+    }
+    // parallel_for_each and the stages of a pipeline keep a copy of the
+    // original lambda, which the runtime calls on the host for small ranges
+    // or without a device
+    SourceRange LambdaRange { CaptureListRange.getBegin(), BodyRange.getEnd() };
+    std::string HostLambda { TheCpuRewriter.getRewrittenText(LambdaRange) };
+
     ExpandSourceRange Range{TheCpuRewriter};
     TheCpuRewriter.ReplaceText(Range(BodyRange), NewLambdaBody.c_str());
     //TheCpuRewriter.ReplaceText(ParamRange, "");
+
+    if (("compute::parallel_for_each" == TheAlgorithm || "compute::map" == TheAlgorithm) && HasHostCopy) {
+        TheCpuRewriter.InsertTextBefore(LambdaRange.getBegin(), "compute::detail::WithHost(");
+        TheCpuRewriter.InsertTextAfterToken(LambdaRange.getEnd(), ", " + HostLambda + ")");
+    }
 }
 
 void LambdaRewiter::RewriteGpuCode()
 {
-    assert(1 == TheParams.size());
+    assert(!TheParams.empty());
 
-    std::string SignatureLambda { TheParams[0].Type + " _Lambda" + PostfixName +
-                "(" + TheParams[0].Type + " " + TheParams[0].VariableName + ") " };
+    std::string LambdaParams;
+    for (unsigned int i = 0; i < TheParams.size(); ++i) {
+        std::string Separator { i == 0 ? "" : ", " };
+        LambdaParams += Separator + TheParams[i].Type + " " + TheParams[i].VariableName;
+    }
+
+    std::string SignatureLambda { TheReturnType + " _Lambda" + PostfixName +
+                "(" + LambdaParams + GetCaptureParams() + ") " };
     std::string BodyLambda { TheCpuRewriter.getRewrittenText(BodyRange) };
 
-    std::string SignatureKernel { std::string {"extern \"C\" void _Kernel"} + PostfixName +
-                "(" + TheParams[0].Type + "* in, " + TheParams[0].Type + "* out) " } ;
-    std::string BodyKernel { "{ unsigned idx = get_global_id(0); out[idx] = _Lambda" + PostfixName + "(in[idx]); }" };
+    std::string Kernels { SignatureLambda + BodyLambda + "\n\n" };
+    if ("compute::parallel_for" == TheAlgorithm)
+        Kernels += GetIndexKernel();
+    else if ("compute::reduce" == TheAlgorithm)
+        Kernels += GetReduceKernel();
+    else if ("compute::inclusive_scan" == TheAlgorithm || "compute::exclusive_scan" == TheAlgorithm)
+        Kernels += GetScanKernels();
+    else if ("compute::map" != TheAlgorithm)
+        Kernels += GetTransformKernels();
+    // The stages of a pipeline share the kernel of the pipeline
 
     SourceManager& SM = TheGpuRewriter.getSourceMgr();
     std::pair<FileID, unsigned> locInfo = SM.getDecomposedLoc(BodyRange.getEnd());
     SourceLocation Eof = SM.getLocForEndOfFile(locInfo.first);
-    TheGpuRewriter.InsertTextAfter(Eof, SignatureLambda + BodyLambda + "\n\n" + SignatureKernel + BodyKernel);
+    TheGpuRewriter.InsertTextAfter(Eof, Kernels);
+}
+
+/// Captures follow the kernel's other parameters: scalars by value, arrays
+/// and vectors as buffers
+std::string LambdaRewiter::GetCaptureParams(const std::string& Suffix) const
+{
+    std::string CaptureParams;
+    for (const DeclarationInfoList* List : {&TheCapturesByValue, &TheCapturesByRef}) {
+        for (const DeclarationInfo& Capture : *List) {
+            std::string Type { Capture.ValueType.empty() ? Capture.Type : Capture.ValueType + "*" };
+            CaptureParams += ", " + Type + " " + Capture.VariableName + Suffix;
+        }
+    }
+    return CaptureParams;
+}
+
+std::string LambdaRewiter::GetCaptureArgs(const std::string& Suffix) const
+{
+    std::string CaptureArgs;
+    for (const DeclarationInfoList* List : {&TheCapturesByValue, &TheCapturesByRef}) {
+        for (const DeclarationInfo& Capture : *List)
+            CaptureArgs += ", " + Capture.VariableName + Suffix;
+    }
+    return CaptureArgs;
+}
+
+/// pipeline: out[idx] = _Lambda_2(_Lambda_1(in[idx], ...), ...), one kernel
+/// for all the stages, so that no intermediate result leaves the device. It
+/// is named after the stages, e.g. _Kernel_1_2, and takes the captures of
+/// every stage in turn, suffixed with the position of the stage.
+std::string LambdaRewiter::GetPipelineKernels(const std::vector<std::unique_ptr<LambdaRewiter>>& Stages)
+{
+    assert(!Stages.empty());
+    std::string Postfix;
+    std::string CaptureParams;
+    for (unsigned int i = 0; i < Stages.size(); ++i) {
+        assert(1 == Stages[i]->TheParams.size());
+        Postfix += Stages[i]->PostfixName;
+        CaptureParams += Stages[i]->GetCaptureParams("_" + std::to_string(i));
+    }
+    auto Compose = [&Stages](std::string Value) {
+        for (unsigned int i = 0; i < Stages.size(); ++i)
+            Value = "_Lambda" + Stages[i]->PostfixName + "(" + Value + Stages[i]->GetCaptureArgs("_" + std::to_string(i)) + ")";
+        return Value;
+    };
+
+    const std::string& InType { Stages.front()->TheParams[0].Type };
+    const std::string& OutType { Stages.back()->TheReturnType };
+    std::string SignatureKernel { "extern \"C\" void _Kernel" + Postfix +
+                "(" + InType + "* in, " + OutType + "* out" + CaptureParams + ") " };
+    std::string BodyKernel { "{ unsigned idx = get_global_id(0); out[idx] = " + Compose("in[idx]") + "; }" };
+
+    std::string Kernels { "\n\n" + SignatureKernel + BodyKernel };
+    if (InType == OutType) {
+        std::string SignatureInPlaceKernel { "extern \"C\" void _Kernel" + Postfix +
+                    "_inplace(" + InType + "* inout" + CaptureParams + ") " };
+        std::string BodyInPlaceKernel { "{ unsigned idx = get_global_id(0); inout[idx] = " + Compose("inout[idx]") + "; }" };
+        Kernels += "\n\n" + SignatureInPlaceKernel + BodyInPlaceKernel;
+    }
+    return Kernels;
+}
+
+/// parallel_for_each: out[idx] = _Lambda(in0[idx], in1[idx], ...), with one
+/// kernel argument per input range
+std::string LambdaRewiter::GetTransformKernels() const
+{
+    std::string KernelParams;
+    std::string KernelArgs;
+    for (unsigned int i = 0; i < TheParams.size(); ++i) {
+        std::string In { TheParams.size() == 1 ? "in" : "in" + std::to_string(i) };
+        std::string Separator { i == 0 ? "" : ", " };
+        KernelParams += TheParams[i].Type + "* " + In + ", ";
+        KernelArgs += Separator + In + "[idx]";
+    }
+
+    std::string SignatureKernel { std::string {"extern \"C\" void _Kernel"} + PostfixName +
+                "(" + KernelParams + TheReturnType + "* out" + GetCaptureParams() + ") " } ;
+    std::string BodyKernel { "{ unsigned idx = get_global_id(0); out[idx] = _Lambda" + PostfixName +
+                "(" + KernelArgs + GetCaptureArgs() + "); }" };
+
+    std::string Kernels { SignatureKernel + BodyKernel };
+
+    // Used when the output range is the input range: one buffer instead of two
+    if (TheParams.size() == 1 && TheParams[0].Type == TheReturnType) {
+        std::string SignatureInPlaceKernel { std::string {"extern \"C\" void _Kernel"} + PostfixName +
+                    "_inplace(" + TheParams[0].Type + "* inout" + GetCaptureParams() + ") " } ;
+        std::string BodyInPlaceKernel { "{ unsigned idx = get_global_id(0); inout[idx] = _Lambda" + PostfixName +
+                    "(inout[idx]" + GetCaptureArgs() + "); }" };
+        Kernels += "\n\n" + SignatureInPlaceKernel + BodyInPlaceKernel;
+    }
+    return Kernels;
+}
+
+/// parallel_for: the index of dimension k is get_global_id(N-1-k), so the
+/// last, fastest varying, dimension is NDRange dimension 0 and neighbouring
+/// work-items write neighbouring elements of the row-major output
+std::string LambdaRewiter::GetIndexKernel() const
+{
+    assert(TheRank >= 1 && TheRank <= 3);
+    std::string N { std::to_string(TheRank) };
+
+    std::string SignatureKernel { std::string {"extern \"C\" void _Kernel"} + PostfixName +
+                "(" + TheReturnType + "* out" + GetCaptureParams() + ") " };
+    std::string BodyKernel { "{ compute::index<" + N + "> idx; " };
+    for (unsigned int k = 0; k < TheRank; ++k)
+        BodyKernel += "idx.Values[" + std::to_string(k) + "] = get_global_id(" + std::to_string(TheRank - 1 - k) + "); ";
+    BodyKernel += "unsigned long long linear = idx.Values[0]; ";
+    for (unsigned int k = 1; k < TheRank; ++k)
+        BodyKernel += "linear = linear * get_global_size(" + std::to_string(TheRank - 1 - k) + ") + idx.Values[" +
+                std::to_string(k) + "]; ";
+    BodyKernel += "out[linear] = _Lambda" + PostfixName + "(idx" + GetCaptureArgs() + "); }";
+
+    return SignatureKernel + BodyKernel;
+}
+
+/// reduce: every work-group reduces its 'n' or fewer elements of 'in' to
+/// out[group] with a tree reduction in local memory. The runtime launches it
+/// again on the partial results until a single value is left.
+std::string LambdaRewiter::GetReduceKernel() const
+{
+    const std::string& Type { TheReturnType };
+    std::string Lambda { "_Lambda" + PostfixName };
+
+    std::string SignatureKernel { std::string {"extern \"C\" void _Kernel"} + PostfixName +
+                "(" + Type + "* in, " + Type + "* out, __attribute__((address_space(3))) " + Type + "* scratch, "
+                "unsigned n" + GetCaptureParams() + ") " };
+    std::string BodyKernel {
+        "{ unsigned lid = get_local_id(0); unsigned size = get_local_size(0); unsigned group = get_group_id(0); "
+        "unsigned first = group * size; unsigned count = n - first < size ? n - first : size; "
+        "if (lid < count) scratch[lid] = in[first + lid]; "
+        "barrier(1); "
+        "for (unsigned s = size / 2; s > 0; s >>= 1) { "
+        "if (lid < s && lid + s < count) scratch[lid] = " + Lambda + "(scratch[lid], scratch[lid + s]" + GetCaptureArgs() + "); "
+        "barrier(1); } "
+        "if (lid == 0) out[group] = scratch[0]; }" };
+
+    return SignatureKernel + BodyKernel;
+}
+
+/// inclusive_scan and exclusive_scan: every work-group scans a block of two
+/// elements per work-item in place with a Brent-Kung scan in local memory,
+/// and stores the block's total in sums[group]. Once the runtime has scanned
+/// the block totals, the propagate kernel adds them to the following blocks.
+std::string LambdaRewiter::GetScanKernels() const
+{
+    const std::string& Type { TheReturnType };
+    std::string Lambda { "_Lambda" + PostfixName };
+
+    std::string SignatureKernel { std::string {"extern \"C\" void _Kernel"} + PostfixName +
+                "(" + Type + "* data, " + Type + "* sums, __attribute__((address_space(3))) " + Type + "* scratch, "
+                "unsigned n" + GetCaptureParams() + ") " };
+    std::string BodyKernel {
+        "{ unsigned lid = get_local_id(0); unsigned size = get_local_size(0); unsigned group = get_group_id(0); "
+        "unsigned block = 2 * size; unsigned first = group * block; "
+        "unsigned count = n - first < block ? n - first : block; "
+        "if (lid < count) scratch[lid] = data[first + lid]; "
+        "if (lid + size < count) scratch[lid + size] = data[first + lid + size]; "
+        "for (unsigned stride = 1; stride < block; stride *= 2) { "
+        "barrier(1); unsigned i = (lid + 1) * stride * 2 - 1; "
+        "if (i < count) scratch[i] = " + Lambda + "(scratch[i - stride], scratch[i]" + GetCaptureArgs() + "); } "
+        "for (unsigned stride = block / 4; stride > 0; stride /= 2) { "
+        "barrier(1); unsigned i = (lid + 1) * stride * 2 - 1; "
+        "if (i + stride < count) scratch[i + stride] = " + Lambda + "(scratch[i], scratch[i + stride]" + GetCaptureArgs() + "); } "
+        "barrier(1); "
+        "if (lid < count) data[first + lid] = scratch[lid]; "
+        "if (lid + size < count) data[first + lid + size] = scratch[lid + size]; "
+        "if (lid == 0) sums[group] = scratch[count - 1]; }" };
+
+    std::string SignaturePropagateKernel { std::string {"extern \"C\" void _Kernel"} + PostfixName +
+                "_propagate(" + Type + "* data, " + Type + "* sums, unsigned n" + GetCaptureParams() + ") " };
+    std::string BodyPropagateKernel {
+        "{ unsigned lid = get_local_id(0); unsigned size = get_local_size(0); unsigned group = get_group_id(0); "
+        "unsigned first = group * 2 * size; "
+        "if (group == 0) return; "
+        "if (first + lid < n) data[first + lid] = " + Lambda + "(sums[group - 1], data[first + lid]" + GetCaptureArgs() + "); "
+        "if (first + lid + size < n) data[first + lid + size] = " + Lambda +
+        "(sums[group - 1], data[first + lid + size]" + GetCaptureArgs() + "); }" };
+
+    return SignatureKernel + BodyKernel + "\n\n" + SignaturePropagateKernel + BodyPropagateKernel;
 }
 
 HasRestrictAttribute::HasRestrictAttribute(FunctionDecl const * const F) :
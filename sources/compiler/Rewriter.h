@@ -3,6 +3,7 @@
 
 #include <memory>
 #include <string>
+#include <vector>
 
 #include <clang/AST/RecursiveASTVisitor.h>
 #include <clang/AST/ASTConsumer.h>
@@ -20,6 +21,11 @@ namespace clang
 namespace compiler {
 
 
+/// The array of the CPU object that holds the OpenCL source. The rewritten
+/// CPU source declares it, and the compiler defines it once the OpenCL
+/// source is generated.
+const char EmbeddedSourceSymbol[] = "cpp_opencl_embedded_source";
+
 /// Rewrite the source code: The result of rewritting the source code
 /// should be two source code files (or strings holding the source);
 /// one that will be compiled on the CPU and the other on the GPU
@@ -54,6 +60,8 @@ public:
 
 protected:
     virtual void OnParallelForEachCall(clang::CallExpr const * const Stmt);
+    virtual void OnPipelineCall(clang::CallExpr const * const Stmt,
+                                const std::vector<clang::CallExpr const *>& Stages);
 private:
     void WriteGpuDeclarators(clang::CallExpr const * const Statement);
 
@@ -65,6 +73,7 @@ private:
     clang::Rewriter TheGpuRewriter;
 
     int ParallelForEachCallCount;
+    bool HasIndexDeclarator;
 
     clang::FunctionDecl const* Func;
 };
@@ -130,16 +139,25 @@ public:
 
     void Rewrite(clang::CallExpr const * const Statement);
 
+    static std::string GetPipelineKernels(const std::vector<std::unique_ptr<LambdaRewiter>>& Stages);
+
 public:
     bool VisitLambdaExpr(clang::LambdaExpr *LE);
     bool VisitDeclStmt(clang::DeclStmt *S);
     bool VisitVarDecl(clang::VarDecl *VD);
+    bool VisitCallExpr(clang::CallExpr *E);
 
 private:
     void ExtractLambdaFunctionInfo(clang::CallExpr const * const Statement);
     void GenerateKernelNamePostfix();
     void RewriteCpuCode();
     void RewriteGpuCode();
+    std::string GetCaptureParams(const std::string& Suffix = "") const;
+    std::string GetCaptureArgs(const std::string& Suffix = "") const;
+    std::string GetTransformKernels() const;
+    std::string GetIndexKernel() const;
+    std::string GetReduceKernel() const;
+    std::string GetScanKernels() const;
 
 private:
     struct DeclarationInfo {
@@ -151,21 +169,34 @@ private:
         // ValueType would be 'int'
         // Type would be 'std::vector<int>'
         // VariableName would be 'A'
+        // ValueType is only set for captured arrays and vectors
     };
 
     using DeclarationInfoList = std::vector<DeclarationInfo>;
 
+    DeclarationInfo GetCaptureInfo(clang::VarDecl const * const D) const;
+
     clang::Rewriter& TheCpuRewriter;
     clang::Rewriter& TheGpuRewriter;
 
     DeclarationInfoList TheCapturesByRef;
     DeclarationInfoList TheCapturesByValue;
     DeclarationInfoList TheParams;
+    std::string TheReturnType;
     clang::SourceRange CaptureListRange;
     clang::SourceRange BodyRange;
     clang::SourceRange ParamRange;
 
     std::string PostfixName;
+
+    // The qualified name of the algorithm, e.g. compute::parallel_for_each
+    std::string TheAlgorithm;
+
+    // The number of dimensions of a parallel_for lambda's index
+    unsigned int TheRank;
+
+    // False if the lambda calls a function that only exists on the GPU
+    bool HasHostCopy;
 };
 
 }
@@ -0,0 +1,187 @@
+#ifndef BufferPool_H
+#define BufferPool_H
+
+#define __CL_ENABLE_EXCEPTIONS
+#include "cl.h"
+
+#include <map>
+#include <mutex>
+#include <vector>
+
+namespace compute {
+
+
+struct BufferPoolStats
+{
+    ::size_t Hits;
+    ::size_t Misses;
+    ::size_t BytesHeld;
+};
+
+
+class BufferPool;
+
+/// A device buffer borrowed from a BufferPool. The buffer goes back to the
+/// pool when the handle is destroyed, unless the pool has been reset since
+/// it was acquired.
+class PooledBuffer
+{
+public:
+    PooledBuffer() : Pool{nullptr}, Size{0}, Generation{0} {}
+    PooledBuffer(BufferPool* P, const cl::Buffer& B, ::size_t S, unsigned G = 0) :
+        Pool{P}, Buffer{B}, Size{S}, Generation{G}
+    {}
+
+    PooledBuffer(const PooledBuffer& that) = delete;
+    PooledBuffer& operator=(const PooledBuffer&) = delete;
+
+    PooledBuffer(PooledBuffer&& that) : Pool{that.Pool}, Buffer{that.Buffer}, Size{that.Size}, Generation{that.Generation}
+    {
+        that.Pool = nullptr;
+    }
+
+    PooledBuffer& operator=(PooledBuffer&& that)
+    {
+        if (this != &that) {
+            Release();
+            Pool = that.Pool;
+            Buffer = that.Buffer;
+            Size = that.Size;
+            Generation = that.Generation;
+            that.Pool = nullptr;
+        }
+        return *this;
+    }
+
+    ~PooledBuffer() { Release(); }
+
+    const cl::Buffer& Get() const { return Buffer; }
+
+    /// Capacity of the buffer, which is at least the requested size
+    ::size_t GetSize() const { return Size; }
+
+private:
+    inline void Release();
+
+    BufferPool* Pool;
+    cl::Buffer Buffer;
+    ::size_t Size;
+    // The generation of the pool the buffer was acquired in
+    unsigned Generation;
+};
+
+
+/// Device buffers are kept in power-of-two size classes and handed out
+/// again instead of being reallocated on every launch. Free buffers are
+/// dropped once the pool holds more than the high-water mark. The pool may
+/// be used from several threads.
+class BufferPool
+{
+public:
+    static const ::size_t DefaultHighWaterMark = 256 * 1024 * 1024;
+    static const ::size_t MinimumBucketSize = 256;
+
+    BufferPool() : HighWaterMark{DefaultHighWaterMark}, Stats(), Generation{0} {}
+
+    BufferPool(const BufferPool& that) = delete;
+    BufferPool& operator=(BufferPool&) = delete;
+
+    /// Drop every free buffer and allocate new ones from 'C'. Buffers still
+    /// borrowed belong to the old context and are dropped when released.
+    void Reset(const cl::Context& C)
+    {
+        std::lock_guard<std::mutex> Guard(Lock);
+        Free.clear();
+        Stats.BytesHeld = 0;
+        Context = C;
+        ++Generation;
+    }
+
+    PooledBuffer Acquire(::size_t ByteLength)
+    {
+        ::size_t Size = GetBucketSize(ByteLength);
+        std::lock_guard<std::mutex> Guard(Lock);
+        auto It = Free.find(Size);
+        if (It != Free.end() && !It->second.empty()) {
+            cl::Buffer B = It->second.back();
+            It->second.pop_back();
+            Stats.BytesHeld -= Size;
+            ++Stats.Hits;
+            return PooledBuffer(this, B, Size, Generation);
+        }
+
+        ++Stats.Misses;
+        return PooledBuffer(this, cl::Buffer(Context, CL_MEM_READ_WRITE, Size), Size, Generation);
+    }
+
+    void Release(const cl::Buffer& B, ::size_t Size, unsigned BufferGeneration)
+    {
+        std::lock_guard<std::mutex> Guard(Lock);
+        if (BufferGeneration != Generation || Stats.BytesHeld + Size > HighWaterMark)
+            return;
+        Free[Size].push_back(B);
+        Stats.BytesHeld += Size;
+    }
+
+    /// Release free buffers, largest first, until at most 'Bytes' are held
+    void Trim(::size_t Bytes = 0)
+    {
+        std::lock_guard<std::mutex> Guard(Lock);
+        Drop(Bytes);
+    }
+
+    void SetHighWaterMark(::size_t Bytes)
+    {
+        std::lock_guard<std::mutex> Guard(Lock);
+        HighWaterMark = Bytes;
+        Drop(HighWaterMark);
+    }
+
+    ::size_t GetHighWaterMark() const { return HighWaterMark; }
+
+    BufferPoolStats GetStats() const
+    {
+        std::lock_guard<std::mutex> Guard(Lock);
+        return Stats;
+    }
+
+    static ::size_t GetBucketSize(::size_t ByteLength)
+    {
+        ::size_t Size = MinimumBucketSize;
+        while (Size < ByteLength)
+            Size <<= 1;
+        return Size;
+    }
+
+private:
+    void Drop(::size_t Bytes)
+    {
+        for (auto It = Free.rbegin(); It != Free.rend() && Stats.BytesHeld > Bytes; ++It) {
+            while (!It->second.empty() && Stats.BytesHeld > Bytes) {
+                It->second.pop_back();
+                Stats.BytesHeld -= It->first;
+            }
+        }
+    }
+
+    mutable std::mutex Lock;
+    cl::Context Context;
+    std::map< ::size_t, std::vector<cl::Buffer> > Free;
+    ::size_t HighWaterMark;
+    BufferPoolStats Stats;
+    // Incremented with every Reset
+    unsigned Generation;
+};
+
+
+inline void PooledBuffer::Release()
+{
+    if (Pool)
+        Pool->Release(Buffer, Size, Generation);
+    Pool = nullptr;
+}
+
+
+} // namespace compute
+
+#endif
@@ -3,19 +3,437 @@
 
 #define __CL_ENABLE_EXCEPTIONS
 #include "cl.h"
+#include "BufferPool.h"
+#include "ThreadPool.h"
 
 #include <iostream>
 #include <fstream>
+#include <sstream>
 #include <stdexcept>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <unordered_map>
+#include <tuple>
+#include <vector>
+#include <utility>
+#include <iterator>
+#include <algorithm>
+#include <cstdint>
+#include <chrono>
+#include <limits>
+#include <cmath>
+#include <numeric>
+#include <mutex>
+#include <atomic>
+#include <type_traits>
+
+#include <sys/stat.h>
+#include <unistd.h>
 
 namespace compute {
 
 
+namespace detail {
+
+// 64 bit FNV-1a; stable across runs, which std::hash is not required to be
+inline unsigned long long Hash(const void* Data, ::size_t Length, unsigned long long H = 14695981039346656037ULL)
+{
+    const unsigned char* Bytes = static_cast<const unsigned char*>(Data);
+    for (::size_t i = 0; i < Length; ++i) {
+        H ^= Bytes[i];
+        H *= 1099511628211ULL;
+    }
+    return H;
+}
+
+inline unsigned long long Hash(const std::string& Data, unsigned long long H = 14695981039346656037ULL)
+{
+    return Hash(Data.data(), Data.size(), H);
+}
+
+/// The OpenCL sources embedded in the objects generated by cpp_opencl, by
+/// the absolute path of the .cl file they are also written to
+inline std::unordered_map<std::string, const char*>& EmbeddedSources()
+{
+    static std::unordered_map<std::string, const char*> Sources;
+    return Sources;
+}
+
+/// Registers the OpenCL source of an object while the object is loaded. The
+/// rewriter adds one to every source file with kernels. Two objects that
+/// embed different sources under one name, e.g. a file compiled twice with
+/// different options, would run each other's kernels, so the program stops.
+struct EmbeddedSource
+{
+    EmbeddedSource(const char* FileName, const char* Source)
+    {
+        auto Inserted = EmbeddedSources().insert(std::make_pair(std::string(FileName), Source));
+        if (!Inserted.second && std::strcmp(Inserted.first->second, Source) != 0) {
+            std::cerr << "cpp_opencl: different OpenCL sources are embedded for " << FileName << "\n";
+            std::abort();
+        }
+    }
+};
+
+/// Host memory of one kernel argument
+struct HostRange
+{
+    void* Data;
+    ::size_t ElementSize;
+
+    char* At(::size_t Index) const { return static_cast<char*>(Data) + Index * ElementSize; }
+};
+
+template <typename Iterator>
+HostRange MakeHostRange(Iterator It)
+{
+    typedef typename std::iterator_traits<Iterator>::value_type value_type;
+    return HostRange{const_cast<void*>(static_cast<const void*>(&*It)), sizeof(value_type)};
+}
+
+/// The host side of a launch: the kernel reads 'Extent' elements of each
+/// input and writes 'Extent' elements of the output. An in-place launch has
+/// no inputs; its output is uploaded too, and the kernel reads and writes
+/// that single buffer.
+struct LaunchArgs
+{
+    std::vector<HostRange> Inputs;
+    HostRange Output;
+    ::size_t Extent;
+    bool InPlace;
+};
+
+/// Elements [First, First+Count) of the ranges of 'Args'
+inline LaunchArgs Slice(const LaunchArgs& Args, ::size_t First, ::size_t Count)
+{
+    LaunchArgs Part {Args.Inputs, Args.Output, Count, Args.InPlace};
+    for (HostRange& In : Part.Inputs)
+        In.Data = In.At(First);
+    Part.Output.Data = Part.Output.At(First);
+    return Part;
+}
+
+inline void AppendHostRanges(std::vector<HostRange>&) {}
+
+template <typename Iterator, typename... Iterators>
+void AppendHostRanges(std::vector<HostRange>& Ranges, Iterator It, Iterators... Rest)
+{
+    Ranges.push_back(MakeHostRange(It));
+    AppendHostRanges(Ranges, Rest...);
+}
+
+template <typename Iterator1, typename Iterator2>
+bool Aliases(Iterator1 It1, Iterator2 It2)
+{
+    HostRange R1 = MakeHostRange(It1);
+    HostRange R2 = MakeHostRange(It2);
+    return R1.Data == R2.Data && R1.ElementSize == R2.ElementSize;
+}
+
+/// Host memory of an array or std::vector captured by a kernel lambda
+struct CapturedRange
+{
+    const void* Data;
+    ::size_t ByteLength;
+};
+
+// The rewriter passes every capture of a kernel lambda through Capture.
+// Scalars become kernel arguments as they are, arrays and vectors become
+// buffers.
+template <typename T>
+const T& Capture(const T& Value)
+{
+    return Value;
+}
+
+template <typename T, typename Allocator>
+CapturedRange Capture(const std::vector<T, Allocator>& Values)
+{
+    return CapturedRange{Values.data(), Values.size() * sizeof(T)};
+}
+
+template <typename T, ::size_t N>
+CapturedRange Capture(const T (&Values)[N])
+{
+    return CapturedRange{Values, sizeof(Values)};
+}
+
+/// Work-group size tuning of one kernel on one device: the candidate local
+/// sizes, the time measured for each candidate tried so far and the winner
+struct Tuning
+{
+    Tuning() : LocalSize{0}, Done{false} {}
+
+    std::vector< ::size_t> Candidates;
+    std::vector<double> Seconds;
+    ::size_t LocalSize;
+    bool Done;
+};
+
+/// The part of a launch given to one of several devices
+struct Partition
+{
+    ::size_t DeviceIndex;
+    ::size_t Count;
+    cl::Event Done;
+};
+
+/// A rewritten kernel lambda together with a host copy of the original
+/// lambda. Calling it calls the rewritten lambda, so it can be used wherever
+/// the rewritten lambda can.
+template <typename KernelType, typename HostType>
+struct HostKernel
+{
+    KernelType Kernel;
+    HostType Host;
+
+    template <typename... Args>
+    auto operator()(Args... args) const -> decltype(std::declval<const KernelType&>()(args...))
+    {
+        return Kernel(args...);
+    }
+};
+
+/// The compiler wraps the lambdas of parallel_for_each in WithHost
+template <typename KernelType, typename HostType>
+HostKernel<KernelType, HostType> WithHost(const KernelType& Kernel, const HostType& Host)
+{
+    return HostKernel<KernelType, HostType>{Kernel, Host};
+}
+
+/// A command recorded while profiling, whose timestamps are read once it
+/// has completed
+struct ProfileRecord
+{
+    std::string Name;
+    std::string Kind;
+    ::size_t Bytes;
+    cl::Event Event;
+};
+
+inline std::string JsonEscape(const std::string& S)
+{
+    std::string Escaped;
+    for (char C : S) {
+        if (C == '"' || C == '\\')
+            Escaped += '\\';
+        if (static_cast<unsigned char>(C) >= 0x20)
+            Escaped += C;
+    }
+    return Escaped;
+}
+
+/// Measured cost of running one kernel on the host
+struct HostCost
+{
+    HostCost() : SecondsPerElement{0} {}
+
+    double SecondsPerElement;
+};
+
+template < ::size_t... I> struct IndexSequence {};
+
+template < ::size_t N, ::size_t... I>
+struct MakeIndexSequence : MakeIndexSequence<N-1, N-1, I...> {};
+
+template < ::size_t... I>
+struct MakeIndexSequence<0, I...> { typedef IndexSequence<I...> type; };
+
+} // namespace detail
+
+
+/// The size of an N dimensional index space, e.g. extent<2>{rows, cols}.
+/// The last dimension varies fastest, as in a row-major array.
+template <int N>
+struct extent
+{
+    static_assert(N >= 1 && N <= 3, "OpenCL index spaces have one to three dimensions");
+
+    ::size_t Values[N];
+
+    ::size_t operator[](int I) const { return Values[I]; }
+
+    ::size_t size() const
+    {
+        ::size_t Size = 1;
+        for (int I = 0; I < N; ++I)
+            Size *= Values[I];
+        return Size;
+    }
+};
+
+/// A point in an extent<N>, as passed to the lambda of parallel_for. The
+/// rewriter emits the same definition into the OpenCL source.
+template <int N>
+struct index
+{
+    long long Values[N];
+
+    long long operator[](int I) const { return Values[I]; }
+};
+
+
+namespace detail {
+
+// The last, fastest varying, dimension of an extent is dimension 0 of the NDRange
+inline cl::NDRange MakeNDRange(const extent<1>& E) { return cl::NDRange(E[0]); }
+inline cl::NDRange MakeNDRange(const extent<2>& E) { return cl::NDRange(E[1], E[0]); }
+inline cl::NDRange MakeNDRange(const extent<3>& E) { return cl::NDRange(E[2], E[1], E[0]); }
+
+} // namespace detail
+
+
+/// Kernel cache counters: a hit means a kernel was reused without reading
+/// or building its OpenCL source. Binary hits are programs loaded from the
+/// on-disk binary cache instead of being compiled from source.
+struct KernelCacheStats
+{
+    ::size_t Hits;
+    ::size_t Misses;
+    ::size_t BinaryHits;
+    ::size_t BinaryMisses;
+};
+
+
+/// How launches reached the device: by using the host ranges in place or
+/// by copying them to device buffers
+struct LaunchStats
+{
+    ::size_t ZeroCopy;
+    ::size_t Copied;
+};
+
+
+/// Waitable handle for work submitted with parallel_for_each_async. The
+/// device buffers of the launch are held until the work has completed, and,
+/// like a std::future returned by std::async, the destructor waits for it.
+class completion_future
+{
+public:
+    completion_future() {}
+
+    completion_future(const cl::Event& E, std::vector<PooledBuffer>&& B) :
+        Event{E}, Buffers{std::move(B)}
+    {}
+
+    completion_future(const completion_future& that) = delete;
+    completion_future& operator=(const completion_future&) = delete;
+
+    completion_future(completion_future&& that) :
+        Event{that.Event}, Buffers{std::move(that.Buffers)}
+    {
+        that.Event = cl::Event();
+    }
+
+    completion_future& operator=(completion_future&& that)
+    {
+        if (this != &that) {
+            wait();
+            Event = that.Event;
+            Buffers = std::move(that.Buffers);
+            that.Event = cl::Event();
+        }
+        return *this;
+    }
+
+    ~completion_future()
+    {
+        try {
+            wait();
+        } catch(cl::Error& e) {
+            std::cerr << e.what() << ": " << e.err() << "\n";
+        }
+    }
+
+    /// Block until the output has been written back to host memory. Throws
+    /// cl::Error if the work failed; the buffers are released either way.
+    void wait()
+    {
+        cl::Event Done;
+        std::swap(Done, Event);
+        std::vector<PooledBuffer> Held;
+        Held.swap(Buffers);
+        if (!Done())
+            return;
+        Done.wait();
+        // Not every implementation fails the wait for a failed event
+        cl_int Status = Done.getInfo<CL_EVENT_COMMAND_EXECUTION_STATUS>();
+        if (Status < 0)
+            throw cl::Error(Status, "completion_future::wait");
+    }
+
+    /// Has the work finished ? Work that failed, with a negative status, is
+    /// finished too, and wait() throws its error.
+    bool is_ready() const
+    {
+        if (!Event())
+            return true;
+        try {
+            return Event.getInfo<CL_EVENT_COMMAND_EXECUTION_STATUS>() <= CL_COMPLETE;
+        } catch(cl::Error&) {
+            return true;
+        }
+    }
+
+    /// The event of the final read, e.g. for use in an OpenCL wait list
+    const cl::Event& get_event() const { return Event; }
+
+private:
+    cl::Event Event;
+    std::vector<PooledBuffer> Buffers;
+};
+
+
+/// One profiled command: an upload ("write"), a kernel ("kernel"), a
+/// read-back ("read") or a mapping ("map") of kernel 'Name', with the
+/// device timestamps of its queued, submit, start and end states in
+/// nanoseconds
+struct ProfileEntry
+{
+    std::string Name;
+    std::string Kind;
+    ::size_t Bytes;
+    ::size_t Queue;
+    cl_ulong Queued;
+    cl_ulong Submit;
+    cl_ulong Start;
+    cl_ulong End;
+};
+
+/// Execution times of one kind of command of one kernel, in nanoseconds
+struct ProfileStats
+{
+    std::string Name;
+    std::string Kind;
+    ::size_t Count;
+    ::size_t Bytes;
+    cl_ulong Total;
+    cl_ulong P50;
+    cl_ulong P99;
+};
+
+
 class Accelerator
 {
 public:
-    Accelerator()
+    Accelerator() : DevicesGeneration{1}, KernelsGeneration{1}, OptionsGeneration{1}, Launches(), Limits(), ChunkSize{0},
+        ZeroCopy{true}, AutoTuning{false}, HostThreshold{0}, LaunchOverhead{-1}, Profiling{false}
     {
+        if (const char* Dir = std::getenv("CPP_OPENCL_BINARY_CACHE"))
+            BinaryCacheDir = Dir;
+        if (const char* FileName = std::getenv("CPP_OPENCL_TUNING_FILE")) {
+            AutoTuning = true;
+            SetTuningFile(FileName);
+        }
+        if (const char* Elements = std::getenv("CPP_OPENCL_HOST_THRESHOLD"))
+            HostThreshold = std::strtoul(Elements, nullptr, 10);
+        if (const char* FileName = std::getenv("CPP_OPENCL_PROFILE")) {
+            Profiling = true;
+            ProfileFile = FileName;
+        }
+
         try {
             VECTOR_CLASS<cl::Platform> Platforms;
             cl::Platform::get(&Platforms);
@@ -33,6 +451,18 @@ public:
     Accelerator(const Accelerator& that) = delete;
     Accelerator& operator=(Accelerator&) = delete;
 
+    ~Accelerator()
+    {
+        if (ProfileFile.empty())
+            return;
+        try {
+            std::ofstream File(ProfileFile);
+            WriteProfile(File);
+        } catch(cl::Error& e) {
+            std::cerr << e.what() << ": " << e.err() << "\n";
+        }
+    }
+
     static Accelerator& Instance()
     {
         static Accelerator I;
@@ -41,86 +471,1877 @@ public:
 
     void BuildKernel(const std::string& KernelName, const std::string& KernelCode)
     {
+        ThreadState& S = GetThreadState();
+        std::lock_guard<std::recursive_mutex> Guard(Lock);
         try {
-            cl::Program::Sources Sources;
-            Sources.push_back({KernelCode.c_str(),KernelCode.length()});
-            Program = cl::Program(Context,Sources);
-            Program.build({Device});
-            Kernel = cl::Kernel(Program, KernelName.c_str());
+            Program = BuildProgram(KernelCode);
+            S.Kernel = cl::Kernel(Program, KernelName.c_str());
+            S.KernelId = std::to_string(detail::Hash(KernelCode)) + ":" + KernelName;
         } catch(cl::Error& e) {
             std::cerr << e.what() << ": " << e.err() << "\n";
-            std::cerr << "Build Status: " << Program.getBuildInfo<CL_PROGRAM_BUILD_STATUS>(Device) << std::endl;
-            std::cerr << "Build Options:\t" << Program.getBuildInfo<CL_PROGRAM_BUILD_OPTIONS>(Device) << std::endl;
-            std::cerr << "Build Log:\t " << Program.getBuildInfo<CL_PROGRAM_BUILD_LOG>(Device) << std::endl;
+            PrintBuildLog(Program);
         } catch(std::exception& e) {
             std::cerr << e.what() << "\n";
         }
     }
 
-    template <typename InputIterator, typename OutputIterator>
-    void Run(InputIterator begin, InputIterator end, OutputIterator output)
+    /// Make kernel 'KernelName' of the OpenCL source file 'FileName' the
+    /// current kernel of the calling thread. Programs are cached per source
+    /// file, build options and device, so the source is only loaded and built
+    /// the first time a kernel is requested. Every thread creates its own kernel
+    /// objects from the shared programs, as kernel arguments are not
+    /// thread-safe.
+    void LoadKernel(const std::string& FileName, const std::string& KernelName)
     {
-        typedef typename std::iterator_traits<InputIterator>::value_type value_type;
-        int Extent = std::distance(begin, end);
-        ::size_t ByteLength = sizeof(value_type) * (Extent);
+        // The kernel objects are the thread's own, so a hit needs no lock
+        ThreadState& S = GetThreadState();
+        auto It = S.Kernels.find(KernelKey{FileName, KernelName, S.Options, S.Device()});
+        if (It != S.Kernels.end()) {
+            ++CacheStats.Hits;
+            S.Kernel = It->second;
+            S.KernelId = FileName + ":" + KernelName;
+            return;
+        }
 
-        cl::Buffer BufferIn(Context,CL_MEM_READ_WRITE, ByteLength);
-        Queue.enqueueWriteBuffer(BufferIn,CL_TRUE,0,ByteLength, static_cast<void*>(&*begin));
+        ++CacheStats.Misses;
+        std::lock_guard<std::recursive_mutex> Guard(Lock);
+        try {
+            Program = LoadProgram(FileName);
+            S.Kernel = cl::Kernel(Program, KernelName.c_str());
+            S.Kernels[KernelKey{FileName, KernelName, Options, S.Device()}] = S.Kernel;
+            S.KernelId = FileName + ":" + KernelName;
+        } catch(cl::Error& e) {
+            std::cerr << e.what() << ": " << e.err() << "\n";
+            PrintBuildLog(Program);
+            // Launches fail rather than run the previous kernel
+            S.Kernel = cl::Kernel();
+            S.KernelId.clear();
+        }
+    }
 
-        cl::Buffer BufferOut(Context,CL_MEM_READ_WRITE,ByteLength);
+    /// Does the OpenCL source file 'FileName' define kernel 'KernelName' ?
+    bool HasKernel(const std::string& FileName, const std::string& KernelName)
+    {
+        ThreadState& S = GetThreadState();
+        if (S.Kernels.count(KernelKey{FileName, KernelName, S.Options, S.Device()}))
+            return true;
+        std::lock_guard<std::recursive_mutex> Guard(Lock);
+        try {
+            std::string Names = ";" + LoadProgram(FileName).getInfo<CL_PROGRAM_KERNEL_NAMES>() + ";";
+            return Names.find(";" + KernelName + ";") != std::string::npos;
+        } catch(cl::Error&) {
+            return false;
+        }
+    }
 
-        Kernel.setArg(0,BufferIn);
-        Kernel.setArg(1,BufferOut);
-        Queue.enqueueNDRangeKernel(Kernel, cl::NullRange, cl::NDRange(Extent), cl::NullRange);
-        Queue.finish();
+    /// Set the lambda captures returned by a rewritten kernel lambda, i.e. the
+    /// elements of 'Result' following the source file and kernel name, as
+    /// the arguments of the current kernel starting at 'FirstIndex'.
+    template <typename KernelResult>
+    void SetCaptures(cl_uint FirstIndex, const KernelResult& Result)
+    {
+        SetCaptures(FirstIndex, Result,
+                    typename detail::MakeIndexSequence<std::tuple_size<KernelResult>::value - 2>::type());
+    }
 
-        Queue.enqueueReadBuffer(BufferOut,CL_TRUE,0,ByteLength,static_cast<void*>(&*output));
+    /// Drop the device copies of captured arrays and vectors
+    void ClearCaptureCache()
+    {
+        std::lock_guard<std::recursive_mutex> Guard(Lock);
+        Captures.clear();
     }
 
+    /// Options passed to cl::Program::build. Kernels built with different
+    /// options are cached separately.
+    void SetBuildOptions(const std::string& BuildOptions)
+    {
+        std::lock_guard<std::recursive_mutex> Guard(Lock);
+        Options = BuildOptions;
+        ++OptionsGeneration;
+    }
 
-private:
-    void Setup()
+    std::string GetBuildOptions() const
     {
-        Devices = new VECTOR_CLASS<cl::Device>;
-        if (CL_SUCCESS != Platform.getDevices(CL_DEVICE_TYPE_ALL, Devices) || Devices->size() == 0)
-            throw std::runtime_error("Failed to create Accelerator.");
-        Device = (*Devices)[0];
+        std::lock_guard<std::recursive_mutex> Guard(Lock);
+        return Options;
+    }
 
-        std::cout << "Using platform: " << Platform.getInfo<CL_PLATFORM_NAME>()<<"\n";
-        std::cout << "Using device: " << Device.getInfo<CL_DEVICE_NAME>()<<"\n";
+    KernelCacheStats GetKernelCacheStats() const
+    {
+        return KernelCacheStats{CacheStats.Hits, CacheStats.Misses, CacheStats.BinaryHits, CacheStats.BinaryMisses};
+    }
 
-        Context = cl::Context(VECTOR_CLASS<cl::Device>{Device});
+    LaunchStats GetLaunchStats() const
+    {
+        std::lock_guard<std::recursive_mutex> Guard(Lock);
+        return Launches;
+    }
 
-        Queue = cl::CommandQueue(Context,Device);
+    /// Drop the programs and, as each thread next uses the accelerator, its
+    /// kernel objects
+    void ClearKernelCache()
+    {
+        std::lock_guard<std::recursive_mutex> Guard(Lock);
+        Captures.clear();
+        Programs.clear();
+        CacheStats.Hits = 0;
+        CacheStats.Misses = 0;
+        CacheStats.BinaryHits = 0;
+        CacheStats.BinaryMisses = 0;
+        ++KernelsGeneration;
     }
 
-private:
-    VECTOR_CLASS<cl::Device>* Devices;
-    cl::Platform Platform;
-    cl::Device Device;
-    cl::Context Context;
-    cl::CommandQueue Queue;
-    cl::Program Program;
-    cl::Kernel Kernel;
-    cl::Program::Sources Sources;
-};
+    /// Directory where program binaries are stored between runs. The
+    /// default is taken from the CPP_OPENCL_BINARY_CACHE environment
+    /// variable; an empty directory disables the binary cache.
+    void SetBinaryCacheDirectory(const std::string& Dir)
+    {
+        std::lock_guard<std::recursive_mutex> Guard(Lock);
+        BinaryCacheDir = Dir;
+    }
 
+    std::string GetBinaryCacheDirectory() const
+    {
+        std::lock_guard<std::recursive_mutex> Guard(Lock);
+        return BinaryCacheDir;
+    }
 
-template <typename InputIterator, typename OutputIterator, typename KernelType>
-void parallel_for_each(InputIterator begin, InputIterator end, OutputIterator output, const KernelType& F)
-{
-    std::pair<std::string,std::string> Names = F(0);
-    std::ifstream sourceFile(Names.first);
-    if(sourceFile.fail())
-        throw std::runtime_error("Failed to open OpenCL source file.");
-    std::string KernelCode(
-        std::istreambuf_iterator<char>(sourceFile),
-        (std::istreambuf_iterator<char>()));
+    /// Device buffers used by Run are drawn from this pool
+    BufferPool& GetBufferPool() { return Pool; }
 
-    Accelerator& K = Accelerator::Instance();
-    K.BuildKernel(Names.second, KernelCode);
-    K.Run(begin, end, output);
-}
+    /// Run the current kernel over [begin, end). 'Iterators' are the start
+    /// of any further input ranges followed by the output range:
+    /// Run(begin, end, output) or Run(begin, end, input2, ..., output).
+    /// Every buffer is sized and copied with the value type of its own
+    /// iterator, so the output may be narrower or wider than the inputs.
+    template <typename InputIterator, typename... Iterators>
+    void Run(InputIterator begin, InputIterator end, Iterators... rest)
+    {
+        RunAsync(begin, end, rest...).wait();
+    }
+
+    /// Enqueue the upload, the kernel and the read-back without waiting for
+    /// them. The input and output ranges must stay valid until the returned
+    /// future is ready. The launches of a thread go through its own in-order
+    /// queue, so a launch reading the output of a previous one sees its
+    /// results.
+    template <typename InputIterator, typename... Iterators>
+    completion_future RunAsync(InputIterator begin, InputIterator end, Iterators... rest)
+    {
+        static_assert(sizeof...(Iterators) > 0, "RunAsync needs an output iterator");
+
+        ::size_t Extent = std::distance(begin, end);
+        if (Extent == 0) return completion_future();
+
+        detail::LaunchArgs Args {{detail::MakeHostRange(begin)}, detail::HostRange(), Extent, false};
+        detail::AppendHostRanges(Args.Inputs, rest...);
+        Args.Output = Args.Inputs.back();
+        Args.Inputs.pop_back();
+        return Launch(Args);
+    }
+
+    /// The local range of the current kernel over the index space 'Global'
+    /// of parallel_for, unless tuning finds a better one. Dimension 0 gets
+    /// the preferred work-group size multiple and the other dimensions what
+    /// is left of the work-group. Every local size divides its global size,
+    /// as the index kernels have no bounds checks.
+    cl::NDRange GetPreferredLocalRange(const cl::NDRange& Global)
+    {
+        ThreadState& S = GetThreadState();
+        ::size_t Max = S.Kernel.getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(S.Device);
+        ::size_t Multiple = S.Kernel.getWorkGroupInfo<CL_KERNEL_PREFERRED_WORK_GROUP_SIZE_MULTIPLE>(S.Device);
+
+        ::size_t Local[3] = {1, 1, 1};
+        ::size_t Left = Max;
+        for (::size_t d = 0; d < Global.dimensions(); ++d) {
+            ::size_t Limit = d == 0 ? std::min(std::max< ::size_t>(Multiple, 1), Max) : Left;
+            while (Local[d] * 2 <= Limit && Global[d] % (Local[d] * 2) == 0)
+                Local[d] *= 2;
+            Left /= Local[d];
+        }
+        if (Local[0] * Local[1] * Local[2] == 1)
+            return cl::NullRange;
+        switch (Global.dimensions()) {
+        case 1: return cl::NDRange(Local[0]);
+        case 2: return cl::NDRange(Local[0], Local[1]);
+        default: return cl::NDRange(Local[0], Local[1], Local[2]);
+        }
+    }
+
+    /// Launch the current kernel, generated for parallel_for, over an N
+    /// dimensional index space. It writes one element of 'output' per
+    /// index, in row-major order.
+    template <int N, typename OutputIterator>
+    completion_future RunAsync(const extent<N>& Extent, OutputIterator output)
+    {
+        ::size_t Size = Extent.size();
+        if (Size == 0) return completion_future();
+
+        ThreadState& S = GetThreadState();
+        detail::HostRange Output = detail::MakeHostRange(output);
+        std::vector<PooledBuffer> Buffers;
+        Buffers.push_back(Pool.Acquire(Output.ElementSize * Size));
+        S.Kernel.setArg(0, Buffers.back().Get());
+
+        cl::NDRange Global = detail::MakeNDRange(Extent);
+        EnqueueKernel(S.Queue, Global, GetPreferredLocalRange(Global));
+
+        cl::Event Done;
+        S.Queue.enqueueReadBuffer(Buffers.back().Get(), CL_FALSE, 0, Output.ElementSize * Size, Output.Data, nullptr, &Done);
+        Record("read", Done, Output.ElementSize * Size);
+        S.Queue.flush();
+        return completion_future(Done, std::move(Buffers));
+    }
+
+    /// Like RunAsync, but the current kernel is an in-place variant that
+    /// reads and writes a single buffer, halving device memory and transfers.
+    template <typename Iterator>
+    completion_future RunInPlaceAsync(Iterator begin, Iterator end)
+    {
+        ::size_t Extent = std::distance(begin, end);
+        if (Extent == 0) return completion_future();
+
+        detail::LaunchArgs Args {{}, detail::MakeHostRange(begin), Extent, true};
+        return Launch(Args);
+    }
+
+    /// Reduce 'init' and the elements of [begin, end) with the current kernel,
+    /// a reduction kernel generated for compute::reduce. Each pass reduces
+    /// the elements of every work-group to one partial result in local
+    /// memory; passes repeat over the partial results until a single value
+    /// is left, and only that value is read back.
+    template <typename InputIterator, typename T>
+    T Reduce(InputIterator begin, InputIterator end, T init)
+    {
+        typedef typename std::iterator_traits<InputIterator>::value_type value_type;
+        const ::size_t ElementSize = sizeof(value_type);
+        ThreadState& S = GetThreadState();
+
+        // 'init' is element 0, so the kernel needs no identity element
+        value_type Init = init;
+        ::size_t Extent = std::distance(begin, end) + 1;
+        std::vector<PooledBuffer> Buffers;
+        Buffers.push_back(Pool.Acquire(Extent * ElementSize));
+        cl::Event Written;
+        S.Queue.enqueueWriteBuffer(Buffers.back().Get(), CL_FALSE, 0, ElementSize, &Init);
+        if (Extent > 1) {
+            S.Queue.enqueueWriteBuffer(Buffers.back().Get(), CL_FALSE, ElementSize, (Extent - 1) * ElementSize,
+                                     detail::MakeHostRange(begin).Data, nullptr, Profiled(Written));
+            Record("write", Written, (Extent - 1) * ElementSize);
+        }
+
+        ::size_t GroupSize = GetGroupSize(S.Kernel, ElementSize);
+        ::size_t Groups;
+        do {
+            Groups = (Extent + GroupSize - 1) / GroupSize;
+            cl::Buffer In = Buffers.back().Get();
+            Buffers.push_back(Pool.Acquire(Groups * ElementSize));
+            S.Kernel.setArg(0, In);
+            S.Kernel.setArg(1, Buffers.back().Get());
+            S.Kernel.setArg(2, cl::Local(GroupSize * ElementSize));
+            S.Kernel.setArg(3, static_cast<cl_uint>(Extent));
+            cl::Event Launched;
+            S.Queue.enqueueNDRangeKernel(S.Kernel, cl::NullRange, cl::NDRange(Groups * GroupSize), cl::NDRange(GroupSize),
+                                         nullptr, Profiled(Launched));
+            Record("kernel", Launched, 0);
+            Extent = Groups;
+        } while (Groups > 1);
+
+        value_type Result;
+        cl::Event Read;
+        S.Queue.enqueueReadBuffer(Buffers.back().Get(), CL_TRUE, 0, ElementSize, &Result, nullptr, Profiled(Read));
+        Record("read", Read, ElementSize);
+        return Result;
+    }
+
+    /// Scan [begin, end) into 'output' with the scan kernels generated for
+    /// compute::inclusive_scan and compute::exclusive_scan, 'KernelName' and
+    /// 'KernelName'_propagate. Every work-group scans a block of two elements
+    /// per work-item in local memory and stores the block's total; the block
+    /// totals are scanned the same way, level by level, and then added to
+    /// the blocks they follow. An exclusive scan is the inclusive scan of
+    /// 'init' followed by all but the last element.
+    template <typename InputIterator, typename OutputIterator, typename KernelResult>
+    void Scan(InputIterator begin, InputIterator end, OutputIterator output,
+              const KernelResult& Result, const typename std::iterator_traits<InputIterator>::value_type* Init)
+    {
+        typedef typename std::iterator_traits<InputIterator>::value_type value_type;
+        static_assert(std::is_same<value_type, typename std::iterator_traits<OutputIterator>::value_type>::value,
+                      "A scan writes elements of its input type");
+        const ::size_t ElementSize = sizeof(value_type);
+
+        ::size_t Extent = std::distance(begin, end);
+        if (Extent == 0) return;
+        ThreadState& S = GetThreadState();
+
+        // Kernel arguments: data, block totals, (local memory,) size and then the captures
+        LoadKernel(std::get<0>(Result), std::get<1>(Result) + "_propagate");
+        SetCaptures(3, Result);
+        cl::Kernel Propagate = S.Kernel;
+        LoadKernel(std::get<0>(Result), std::get<1>(Result));
+        SetCaptures(4, Result);
+
+        std::vector<PooledBuffer> Levels;
+        Levels.push_back(Pool.Acquire(Extent * ElementSize));
+        cl::Event Written;
+        if (Init) {
+            S.Queue.enqueueWriteBuffer(Levels[0].Get(), CL_FALSE, 0, ElementSize, Init);
+            if (Extent > 1) {
+                S.Queue.enqueueWriteBuffer(Levels[0].Get(), CL_FALSE, ElementSize, (Extent - 1) * ElementSize,
+                                         detail::MakeHostRange(begin).Data, nullptr, Profiled(Written));
+            }
+        } else {
+            S.Queue.enqueueWriteBuffer(Levels[0].Get(), CL_FALSE, 0, Extent * ElementSize,
+                                     detail::MakeHostRange(begin).Data, nullptr, Profiled(Written));
+        }
+        Record("write", Written, (Init ? Extent - 1 : Extent) * ElementSize);
+
+        ::size_t GroupSize = std::min(GetGroupSize(S.Kernel, 2 * ElementSize), GetGroupSize(Propagate, 1));
+        ::size_t BlockSize = 2 * GroupSize;
+
+        std::vector< ::size_t> Extents {Extent};
+        for (;;) {
+            ::size_t Groups = (Extents.back() + BlockSize - 1) / BlockSize;
+            Levels.push_back(Pool.Acquire(Groups * ElementSize));
+            ::size_t Level = Extents.size() - 1;
+            S.Kernel.setArg(0, Levels[Level].Get());
+            S.Kernel.setArg(1, Levels[Level + 1].Get());
+            S.Kernel.setArg(2, cl::Local(BlockSize * ElementSize));
+            S.Kernel.setArg(3, static_cast<cl_uint>(Extents.back()));
+            cl::Event Launched;
+            S.Queue.enqueueNDRangeKernel(S.Kernel, cl::NullRange, cl::NDRange(Groups * GroupSize), cl::NDRange(GroupSize),
+                                         nullptr, Profiled(Launched));
+            Record("kernel", Launched, 0);
+            if (Groups == 1)
+                break;
+            Extents.push_back(Groups);
+        }
+
+        for (::size_t Level = Extents.size() - 1; Level > 0; --Level) {
+            ::size_t Groups = (Extents[Level - 1] + BlockSize - 1) / BlockSize;
+            Propagate.setArg(0, Levels[Level - 1].Get());
+            Propagate.setArg(1, Levels[Level].Get());
+            Propagate.setArg(2, static_cast<cl_uint>(Extents[Level - 1]));
+            cl::Event Launched;
+            S.Queue.enqueueNDRangeKernel(Propagate, cl::NullRange, cl::NDRange(Groups * GroupSize), cl::NDRange(GroupSize),
+                                         nullptr, Profiled(Launched));
+            Record("kernel", Launched, 0);
+        }
+
+        detail::HostRange Output = detail::MakeHostRange(output);
+        cl::Event Read;
+        S.Queue.enqueueReadBuffer(Levels[0].Get(), CL_TRUE, 0, ElementSize * Extent, Output.Data,
+                                  nullptr, Profiled(Read));
+        Record("read", Read, ElementSize * Extent);
+    }
+
+    /// Launches larger than this many elements are split into chunks that are
+    /// streamed through the device. With the default of 0 the chunk size is
+    /// derived from the device limits, and only launches whose buffers would
+    /// not fit on the device are streamed.
+    void SetChunkSize(::size_t Elements) { ChunkSize = Elements; }
+    ::size_t GetChunkSize() const { return ChunkSize; }
+
+    /// On devices that share memory with the host (CPUs, integrated GPUs)
+    /// suitably aligned ranges are used in place with CL_MEM_USE_HOST_PTR
+    /// instead of being copied. Enabled by default; other devices and
+    /// unaligned ranges always take the copy path.
+    void SetZeroCopy(bool Enable) { ZeroCopy = Enable; }
+    bool GetZeroCopy() const { return ZeroCopy; }
+
+    /// Opt-in work-group size tuning. The first launches of each kernel try
+    /// the candidate local sizes in turn, waiting for and timing each one;
+    /// later launches use the fastest. Candidates are the driver's choice
+    /// and the multiples of CL_KERNEL_PREFERRED_WORK_GROUP_SIZE_MULTIPLE up
+    /// to CL_KERNEL_WORK_GROUP_SIZE. Setting the CPP_OPENCL_TUNING_FILE
+    /// environment variable enables tuning and keeps the results in that
+    /// file between runs.
+    void SetAutoTuning(bool Enable) { AutoTuning = Enable; }
+    bool GetAutoTuning() const { return AutoTuning; }
+
+    /// Tuning results are read from and written to this file; an empty
+    /// name keeps them in memory only
+    void SetTuningFile(const std::string& FileName)
+    {
+        std::lock_guard<std::recursive_mutex> Guard(Lock);
+        TuningFile = FileName;
+        LoadTuning();
+    }
+    std::string GetTuningFile() const
+    {
+        std::lock_guard<std::recursive_mutex> Guard(Lock);
+        return TuningFile;
+    }
+
+    /// The local size chosen for kernel 'KernelName' of 'FileName' on the
+    /// current device: 0 for the driver's choice or while it is being tuned
+    ::size_t GetTunedLocalSize(const std::string& FileName, const std::string& KernelName) const
+    {
+        std::lock_guard<std::recursive_mutex> Guard(Lock);
+        auto It = Tunings.find(TuningKey{DeviceId, FileName + ":" + KernelName});
+        return It != Tunings.end() && It->second.Done ? It->second.LocalSize : 0;
+    }
+
+    void ClearTuning()
+    {
+        std::lock_guard<std::recursive_mutex> Guard(Lock);
+        Tunings.clear();
+    }
+
+    /// Split parallel_for_each launches across 'Selected', for example the
+    /// GPUs of the platform or sub-devices created with clCreateSubDevices.
+    /// The first device is the primary device: it runs reductions, scans and
+    /// parallel_for, and its limits apply to every launch. Kernels are
+    /// rebuilt for the new devices. Other threads must not launch work while
+    /// devices are being selected.
+    void SelectDevices(const VECTOR_CLASS<cl::Device>& Selected)
+    {
+        if (Selected.empty())
+            throw std::runtime_error("No device selected.");
+        GetThreadState().Queue.finish();
+        std::lock_guard<std::recursive_mutex> Guard(Lock);
+        ClearKernelCache();
+        SetupDevices(Selected);
+    }
+
+    VECTOR_CLASS<cl::Device> GetDevices() const
+    {
+        std::lock_guard<std::recursive_mutex> Guard(Lock);
+        return SelectedDevices;
+    }
+
+    cl::Context GetContext() const
+    {
+        std::lock_guard<std::recursive_mutex> Guard(Lock);
+        return Context;
+    }
+
+    /// The primary device
+    cl::Device GetDevice() const
+    {
+        std::lock_guard<std::recursive_mutex> Guard(Lock);
+        return Device;
+    }
+
+    /// A new kernel object for kernel 'KernelName' of the OpenCL source file
+    /// 'FileName', built from the shared program. Its arguments are
+    /// independent of the current kernel's.
+    cl::Kernel CreateKernel(const std::string& FileName, const std::string& KernelName)
+    {
+        std::lock_guard<std::recursive_mutex> Guard(Lock);
+        return cl::Kernel(LoadProgram(FileName), KernelName.c_str());
+    }
+
+    /// The share of a launch each selected device gets. The weights start
+    /// out proportional to compute units times clock frequency and then
+    /// follow the throughput measured on each device. Setting weights fixes
+    /// them; setting no weights goes back to measuring.
+    void SetDeviceWeights(const std::vector<double>& Weights)
+    {
+        std::lock_guard<std::recursive_mutex> Guard(Lock);
+        if (!Weights.empty() && Weights.size() != SelectedDevices.size())
+            throw std::runtime_error("Expected one weight per selected device.");
+        MeasureWeights = Weights.empty();
+        if (!Weights.empty()) {
+            DeviceWeights = Weights;
+            NormalizeWeights(DeviceWeights);
+        }
+    }
+
+    std::vector<double> GetDeviceWeights() const
+    {
+        std::lock_guard<std::recursive_mutex> Guard(Lock);
+        return DeviceWeights;
+    }
+
+    /// The number of elements each selected device got in the calling
+    /// thread's last launch split across devices
+    std::vector< ::size_t> GetPartitionSizes()
+    {
+        ThreadState& S = GetThreadState();
+        std::vector< ::size_t> Sizes(S.DeviceQueues.size());
+        for (const detail::Partition& P : S.Partitions)
+            Sizes[P.DeviceIndex] = P.Count;
+        return Sizes;
+    }
+
+    /// Is there a device to launch kernels on ?
+    bool HasDevice() const
+    {
+        std::lock_guard<std::recursive_mutex> Guard(Lock);
+        return Context() != nullptr;
+    }
+
+    /// parallel_for_each runs lambdas compiled with a host copy on the host
+    /// thread pool for ranges of fewer elements than this threshold, where
+    /// buffer transfers and the launch would cost more than the work itself.
+    /// With the default of 0 the threshold is calibrated for each kernel:
+    /// the latency of a device round trip divided by the host time per
+    /// element measured so far. The default is taken from the
+    /// CPP_OPENCL_HOST_THRESHOLD environment variable.
+    void SetHostThreshold(::size_t Elements) { HostThreshold = Elements; }
+
+    /// The threshold for kernel 'KernelName' of 'FileName'
+    ::size_t GetHostThreshold(const std::string& FileName, const std::string& KernelName)
+    {
+        if (::size_t Configured = HostThreshold)
+            return Configured;
+
+        std::lock_guard<std::recursive_mutex> Guard(Lock);
+        auto It = HostCosts.find(FileName + ":" + KernelName);
+        if (It == HostCosts.end() || It->second.SecondsPerElement <= 0)
+            return DefaultHostThreshold;
+        return static_cast< ::size_t>(GetLaunchOverhead() / It->second.SecondsPerElement);
+    }
+
+    /// The shortest of a few launches of an empty kernel on one element,
+    /// with its upload and read-back, measured once
+    double GetLaunchOverhead()
+    {
+        std::lock_guard<std::recursive_mutex> Guard(Lock);
+        if (LaunchOverhead >= 0)
+            return LaunchOverhead;
+
+        ThreadState& S = GetThreadState();
+        const std::string KernelCode = "__kernel void _Kernel_empty(__global int* x) { }";
+        cl::Program::Sources Sources;
+        Sources.push_back({KernelCode.c_str(), KernelCode.length()});
+        cl::Program P(Context, Sources);
+        P.build({S.Device}, Options.c_str());
+        cl::Kernel Empty(P, "_Kernel_empty");
+
+        PooledBuffer B = Pool.Acquire(sizeof(cl_int));
+        Empty.setArg(0, B.Get());
+        cl_int Value = 0;
+        LaunchOverhead = std::numeric_limits<double>::max();
+        for (int i = 0; i < 3; ++i) {
+            auto Start = std::chrono::steady_clock::now();
+            S.Queue.enqueueWriteBuffer(B.Get(), CL_FALSE, 0, sizeof(Value), &Value);
+            S.Queue.enqueueNDRangeKernel(Empty, cl::NullRange, cl::NDRange(1), cl::NullRange);
+            S.Queue.enqueueReadBuffer(B.Get(), CL_TRUE, 0, sizeof(Value), &Value);
+            LaunchOverhead = std::min(LaunchOverhead,
+                std::chrono::duration<double>(std::chrono::steady_clock::now() - Start).count());
+        }
+        return LaunchOverhead;
+    }
+
+    /// Should 'Extent' elements of the kernel run on the host ?
+    bool UseHost(const std::string& FileName, const std::string& KernelName, ::size_t Extent)
+    {
+        return !HasDevice() || Extent < GetHostThreshold(FileName, KernelName);
+    }
+
+    /// Record that 'Extent' elements of the kernel took 'Seconds' on the host
+    void AddHostTime(const std::string& FileName, const std::string& KernelName, ::size_t Extent, double Seconds)
+    {
+        if (Extent == 0)
+            return;
+        std::lock_guard<std::recursive_mutex> Guard(Lock);
+        detail::HostCost& C = HostCosts[FileName + ":" + KernelName];
+        double Cost = Seconds / Extent;
+        C.SecondsPerElement = C.SecondsPerElement > 0 ? 0.5 * C.SecondsPerElement + 0.5 * Cost : Cost;
+    }
+
+    /// Record the device timestamps of every upload, kernel and read-back.
+    /// Queues are created with CL_QUEUE_PROFILING_ENABLE while profiling is
+    /// on. Setting the CPP_OPENCL_PROFILE environment variable enables
+    /// profiling and writes the trace to that file at exit.
+    void SetProfiling(bool Enable)
+    {
+        std::lock_guard<std::recursive_mutex> Guard(Lock);
+        if (Profiling != Enable) {
+            Profiling = Enable;
+            ++DevicesGeneration;
+        }
+    }
+    bool GetProfiling() const
+    {
+        std::lock_guard<std::recursive_mutex> Guard(Lock);
+        return Profiling;
+    }
+
+    /// The commands completed so far, in the order they were enqueued.
+    /// Commands that have not completed yet are left for a later call.
+    std::vector<ProfileEntry> GetProfileEntries()
+    {
+        std::lock_guard<std::recursive_mutex> Guard(Lock);
+        ResolveProfile();
+        return ProfileEntries;
+    }
+
+    /// The completed commands grouped by kernel and kind of command
+    std::vector<ProfileStats> GetProfileStats()
+    {
+        std::map<std::pair<std::string, std::string>, std::vector<cl_ulong>> Durations;
+        std::map<std::pair<std::string, std::string>, ::size_t> Bytes;
+        for (const ProfileEntry& E : GetProfileEntries()) {
+            auto Key = std::make_pair(E.Name, E.Kind);
+            Durations[Key].push_back(E.End - E.Start);
+            Bytes[Key] += E.Bytes;
+        }
+
+        std::vector<ProfileStats> Stats;
+        for (auto& Entry : Durations) {
+            std::vector<cl_ulong>& D = Entry.second;
+            std::sort(D.begin(), D.end());
+            // Nearest-rank percentiles
+            auto Percentile = [&D](double P) { return D[static_cast< ::size_t>(std::ceil(P * D.size())) - 1]; };
+            Stats.push_back(ProfileStats{Entry.first.first, Entry.first.second, D.size(), Bytes[Entry.first],
+                                         std::accumulate(D.begin(), D.end(), cl_ulong(0)),
+                                         Percentile(0.5), Percentile(0.99)});
+        }
+        return Stats;
+    }
+
+    /// Write the completed commands in the Chrome trace event format, which
+    /// chrome://tracing and Perfetto load, with one track per queue. The
+    /// aggregated statistics are added under "stats".
+    void WriteProfile(std::ostream& Out)
+    {
+        std::vector<ProfileEntry> Entries = GetProfileEntries();
+        cl_ulong Origin = std::numeric_limits<cl_ulong>::max();
+        for (const ProfileEntry& E : Entries)
+            Origin = std::min(Origin, E.Queued);
+
+        Out << "{\"traceEvents\":[";
+        for (::size_t i = 0; i < Entries.size(); ++i) {
+            const ProfileEntry& E = Entries[i];
+            Out << (i == 0 ? "" : ",") << "\n{\"name\":\"" << detail::JsonEscape(E.Name) << "\",\"cat\":\"" << E.Kind
+                << "\",\"ph\":\"X\",\"pid\":0,\"tid\":" << E.Queue
+                << ",\"ts\":" << (E.Start - Origin) / 1000.0 << ",\"dur\":" << (E.End - E.Start) / 1000.0
+                << ",\"args\":{\"bytes\":" << E.Bytes << ",\"queued\":" << E.Queued - Origin
+                << ",\"submit\":" << E.Submit - Origin << "}}";
+        }
+        Out << "\n],\"displayTimeUnit\":\"ns\",\"stats\":[";
+        std::vector<ProfileStats> Stats = GetProfileStats();
+        for (::size_t i = 0; i < Stats.size(); ++i) {
+            const ProfileStats& S = Stats[i];
+            Out << (i == 0 ? "" : ",") << "\n{\"name\":\"" << detail::JsonEscape(S.Name) << "\",\"kind\":\"" << S.Kind
+                << "\",\"count\":" << S.Count << ",\"bytes\":" << S.Bytes << ",\"total_ns\":" << S.Total
+                << ",\"p50_ns\":" << S.P50 << ",\"p99_ns\":" << S.P99 << "}";
+        }
+        Out << "\n]}\n";
+    }
+
+    void ClearProfile()
+    {
+        std::lock_guard<std::recursive_mutex> Guard(Lock);
+        PendingProfile.clear();
+        ProfileEntries.clear();
+        ProfileQueues.clear();
+    }
+
+
+private:
+    void Setup()
+    {
+        Devices = new VECTOR_CLASS<cl::Device>;
+        if (CL_SUCCESS != Platform.getDevices(CL_DEVICE_TYPE_ALL, Devices) || Devices->size() == 0)
+            throw std::runtime_error("Failed to create Accelerator.");
+
+        std::cout << "Using platform: " << Platform.getInfo<CL_PLATFORM_NAME>()<<"\n";
+        SetupDevices(VECTOR_CLASS<cl::Device>{(*Devices)[0]});
+    }
+
+    /// Create the context for 'Selected'. The first device is
+    /// the primary device, whose limits apply to every launch.
+    void SetupDevices(const VECTOR_CLASS<cl::Device>& Selected)
+    {
+        SelectedDevices = Selected;
+        Device = Selected[0];
+        for (const cl::Device& D : Selected)
+            std::cout << "Using device: " << D.getInfo<CL_DEVICE_NAME>()<<"\n";
+
+        Context = cl::Context(Selected);
+
+        // Every thread creates its queues on its first launch
+        ++DevicesGeneration;
+
+        DeviceWeights.clear();
+        MeasureWeights = true;
+        if (Selected.size() > 1) {
+            for (const cl::Device& D : Selected) {
+                DeviceWeights.push_back(double(D.getInfo<CL_DEVICE_MAX_COMPUTE_UNITS>()) *
+                                        std::max<cl_uint>(D.getInfo<CL_DEVICE_MAX_CLOCK_FREQUENCY>(), 1));
+            }
+        } else {
+            DeviceWeights.push_back(1);
+        }
+        NormalizeWeights(DeviceWeights);
+
+        Limits.MaxAllocSize = Device.getInfo<CL_DEVICE_MAX_MEM_ALLOC_SIZE>();
+        Limits.GlobalMemSize = Device.getInfo<CL_DEVICE_GLOBAL_MEM_SIZE>();
+        Limits.HostUnifiedMemory = Device.getInfo<CL_DEVICE_HOST_UNIFIED_MEMORY>();
+        Limits.BaseAddressAlign = Device.getInfo<CL_DEVICE_MEM_BASE_ADDR_ALIGN>() / 8;
+        Limits.LocalMemSize = Device.getInfo<CL_DEVICE_LOCAL_MEM_SIZE>();
+        DeviceId = Device.getInfo<CL_DEVICE_NAME>() + " " + Device.getInfo<CL_DRIVER_VERSION>();
+
+        Pool.Reset(Context);
+    }
+
+    static void NormalizeWeights(std::vector<double>& Weights)
+    {
+        double Sum = std::accumulate(Weights.begin(), Weights.end(), 0.0);
+        for (double& W : Weights)
+            W = Sum > 0 ? W / Sum : 1.0 / Weights.size();
+    }
+
+    /// The event argument of an enqueue: 'E' if the thread's queues were
+    /// created for profiling, so that the command can be recorded, and none
+    /// otherwise
+    cl::Event* Profiled(cl::Event& E) const { return GetCurrentThreadState().Profiling ? &E : nullptr; }
+
+    /// Keep the event of a command of the current kernel until it completes
+    void Record(const char* Kind, const cl::Event& E, ::size_t Bytes)
+    {
+        const ThreadState& S = GetCurrentThreadState();
+        if (!S.Profiling || !E())
+            return;
+        const std::string& Name = S.KernelId;
+        std::lock_guard<std::recursive_mutex> Guard(Lock);
+        PendingProfile.push_back(detail::ProfileRecord{Name, Kind, Bytes, E});
+        if (PendingProfile.size() >= MaxPendingProfile)
+            ResolveProfile();
+    }
+
+    /// Read the timestamps of the recorded commands that have completed
+    void ResolveProfile()
+    {
+        std::vector<detail::ProfileRecord> Pending;
+        for (detail::ProfileRecord& R : PendingProfile) {
+            cl_int Status = R.Event.getInfo<CL_EVENT_COMMAND_EXECUTION_STATUS>();
+            if (Status > CL_COMPLETE) {
+                Pending.push_back(R);
+                continue;
+            }
+            if (Status < 0)
+                continue;
+            // A command of a queue created without profiling has no timestamps
+            ProfileEntry Entry;
+            try {
+                Entry = ProfileEntry{R.Name, R.Kind, R.Bytes, 0,
+                    R.Event.getProfilingInfo<CL_PROFILING_COMMAND_QUEUED>(),
+                    R.Event.getProfilingInfo<CL_PROFILING_COMMAND_SUBMIT>(),
+                    R.Event.getProfilingInfo<CL_PROFILING_COMMAND_START>(),
+                    R.Event.getProfilingInfo<CL_PROFILING_COMMAND_END>()};
+            } catch(cl::Error&) {
+                continue;
+            }
+            cl_command_queue Q = R.Event.getInfo<CL_EVENT_COMMAND_QUEUE>()();
+            Entry.Queue = ProfileQueues.insert(std::make_pair(Q, ProfileQueues.size())).first->second;
+            ProfileEntries.push_back(Entry);
+        }
+        PendingProfile.swap(Pending);
+    }
+
+    completion_future Launch(const detail::LaunchArgs& Args)
+    {
+        ThreadState& S = GetThreadState();
+        if (S.DeviceQueues.size() > 1)
+            return LaunchMultiDevice(Args);
+
+        ::size_t Chunk = GetChunkSize(Args);
+        if (Chunk < Args.Extent)
+            return LaunchStreamed(Args, Chunk);
+        if (ZeroCopy && IsHostAccessible(Args))
+            return LaunchZeroCopy(Args);
+
+        CountLaunch(&LaunchStats::Copied);
+        std::vector<PooledBuffer> Buffers;
+        cl::Event Done;
+        EnqueueRange(S.Queue, Args, 0, Args.Extent, Args.Extent, Buffers, nullptr, &Done);
+        S.Queue.flush();
+        return completion_future(Done, std::move(Buffers));
+    }
+
+    /// Give each selected device a contiguous part of the range, sized by
+    /// its weight, and run the parts concurrently on the device queues. Each
+    /// part runs in place or in chunks like a launch on one device.
+    completion_future LaunchMultiDevice(const detail::LaunchArgs& Args)
+    {
+        ThreadState& S = GetThreadState();
+        std::vector<double> Weights;
+        {
+            std::lock_guard<std::recursive_mutex> Guard(Lock);
+            if (MeasureWeights)
+                UpdateDeviceWeights(S.Partitions);
+            Weights = DeviceWeights;
+        }
+        S.Partitions.clear();
+
+        std::vector<cl::Event> Start(1);
+        S.Queue.enqueueMarkerWithWaitList(nullptr, &Start[0]);
+
+        std::vector<PooledBuffer> Buffers;
+        std::vector<cl::Event> Used;
+        for (::size_t d = 0, First = 0; d < S.DeviceQueues.size() && First < Args.Extent; ++d) {
+            ::size_t Count = d + 1 == S.DeviceQueues.size()
+                ? Args.Extent - First
+                : std::min(Args.Extent - First, static_cast< ::size_t>(Weights[d] * Args.Extent + 0.5));
+            if (Count == 0)
+                continue;
+
+            cl::Event Done;
+            EnqueuePartition(S.DeviceQueues[d], detail::Slice(Args, First, Count), Buffers, &Start, &Done);
+            S.DeviceQueues[d].flush();
+
+            S.Partitions.push_back(detail::Partition{d, Count, Done});
+            Used.push_back(Done);
+            First += Count;
+        }
+
+        cl::Event Done;
+        S.Queue.enqueueMarkerWithWaitList(Used.empty() ? nullptr : &Used, &Done);
+        S.Queue.flush();
+        return completion_future(Done, std::move(Buffers));
+    }
+
+    /// Move the weights halfway towards the throughput each device reached
+    /// in the previous launch. The read-back is enqueued together with the
+    /// upload, so its queued-to-end time spans the whole partition. Launches
+    /// that have not finished yet or left a device out are not used.
+    void UpdateDeviceWeights(const std::vector<detail::Partition>& Partitions)
+    {
+        if (Partitions.size() != DeviceWeights.size())
+            return;
+
+        std::vector<double> Throughput(DeviceWeights.size());
+        for (const detail::Partition& P : Partitions) {
+            if (P.Done.getInfo<CL_EVENT_COMMAND_EXECUTION_STATUS>() != CL_COMPLETE)
+                return;
+            cl_ulong Queued = P.Done.getProfilingInfo<CL_PROFILING_COMMAND_QUEUED>();
+            cl_ulong End = P.Done.getProfilingInfo<CL_PROFILING_COMMAND_END>();
+            Throughput[P.DeviceIndex] = End > Queued ? double(P.Count) / (End - Queued) : 0;
+        }
+
+        if (std::find(Throughput.begin(), Throughput.end(), 0.0) != Throughput.end())
+            return;
+        NormalizeWeights(Throughput);
+        for (::size_t d = 0; d < DeviceWeights.size(); ++d)
+            DeviceWeights[d] = 0.5 * DeviceWeights[d] + 0.5 * Throughput[d];
+    }
+
+    /// Enqueue the part of a launch split across devices on the queue of
+    /// its device. The chunks of a part are enqueued one after the other on
+    /// that in-order queue and share one set of buffers.
+    void EnqueuePartition(cl::CommandQueue& Q, const detail::LaunchArgs& Part, std::vector<PooledBuffer>& Buffers,
+                          const std::vector<cl::Event>* WaitFor, cl::Event* Done)
+    {
+        ::size_t Chunk = GetChunkSize(Part);
+        if (Chunk >= Part.Extent && ZeroCopy && IsHostAccessible(Part)) {
+            CountLaunch(&LaunchStats::ZeroCopy);
+            EnqueueZeroCopy(Q, Part, Buffers, WaitFor, Done);
+            return;
+        }
+
+        CountLaunch(&LaunchStats::Copied);
+        std::vector<PooledBuffer> PartBuffers;
+        for (::size_t First = 0; First < Part.Extent; First += Chunk) {
+            ::size_t Count = std::min(Chunk, Part.Extent - First);
+            EnqueueRange(Q, Part, First, Count, std::min(Chunk, Part.Extent), PartBuffers,
+                         First == 0 ? WaitFor : nullptr, First + Count == Part.Extent ? Done : nullptr);
+        }
+        std::move(PartBuffers.begin(), PartBuffers.end(), std::back_inserter(Buffers));
+    }
+
+    completion_future LaunchZeroCopy(const detail::LaunchArgs& Args)
+    {
+        ThreadState& S = GetThreadState();
+        CountLaunch(&LaunchStats::ZeroCopy);
+        std::vector<PooledBuffer> Buffers;
+        cl::Event Done;
+        EnqueueZeroCopy(S.Queue, Args, Buffers, nullptr, &Done);
+        S.Queue.flush();
+        return completion_future(Done, std::move(Buffers));
+    }
+
+    /// Wrap the host ranges in buffers instead of copying them. Mapping the
+    /// output after the kernel makes its results visible in host memory.
+    void EnqueueZeroCopy(cl::CommandQueue& Q, const detail::LaunchArgs& Args, std::vector<PooledBuffer>& Buffers,
+                         const std::vector<cl::Event>* WaitFor, cl::Event* Done)
+    {
+        ThreadState& S = GetThreadState();
+        for (::size_t i = 0; i < Args.Inputs.size(); ++i) {
+            ::size_t ByteLength = Args.Inputs[i].ElementSize * Args.Extent;
+            cl::Buffer B(Context, CL_MEM_READ_WRITE | CL_MEM_USE_HOST_PTR, ByteLength, Args.Inputs[i].Data);
+            S.Kernel.setArg(i, B);
+            Buffers.push_back(PooledBuffer(nullptr, B, ByteLength));
+        }
+
+        ::size_t ByteLength = Args.Output.ElementSize * Args.Extent;
+        cl::Buffer Out(Context, CL_MEM_READ_WRITE | CL_MEM_USE_HOST_PTR, ByteLength, Args.Output.Data);
+        S.Kernel.setArg(Args.Inputs.size(), Out);
+        Buffers.push_back(PooledBuffer(nullptr, Out, ByteLength));
+
+        if (WaitFor)
+            Q.enqueueMarkerWithWaitList(WaitFor);
+        EnqueueKernel(Q, cl::NDRange(Args.Extent));
+        cl::Event Map;
+        void* Mapped = Q.enqueueMapBuffer(Out, CL_FALSE, CL_MAP_READ, 0, ByteLength, nullptr, Profiled(Map));
+        Record("map", Map, ByteLength);
+        Q.enqueueUnmapMemObject(Out, Mapped, nullptr, Done);
+    }
+
+    void CountLaunch(::size_t LaunchStats::* Counter)
+    {
+        std::lock_guard<std::recursive_mutex> Guard(Lock);
+        ++(Launches.*Counter);
+    }
+
+    /// Can the device use the host memory of the launch in place ? An output
+    /// overlapping an input would be wrapped in two buffers over the same
+    /// memory, whose contents are undefined, so such launches are copied
+    /// unless they run an in-place kernel on a single buffer.
+    bool IsHostAccessible(const detail::LaunchArgs& Args)
+    {
+        const DeviceLimits& L = GetThreadState().Limits;
+        if (!L.HostUnifiedMemory || L.BaseAddressAlign == 0)
+            return false;
+        auto Aligned = [&L](const detail::HostRange& R) {
+            return reinterpret_cast<uintptr_t>(R.Data) % L.BaseAddressAlign == 0;
+        };
+        const char* OutFirst = Args.Output.At(0);
+        const char* OutLast = Args.Output.At(Args.Extent);
+        auto Overlaps = [&Args, OutFirst, OutLast](const detail::HostRange& R) {
+            return R.At(0) < OutLast && OutFirst < R.At(Args.Extent);
+        };
+        return Aligned(Args.Output) && std::all_of(Args.Inputs.begin(), Args.Inputs.end(), Aligned) &&
+               std::none_of(Args.Inputs.begin(), Args.Inputs.end(), Overlaps);
+    }
+
+    /// Split the range into chunks and spread them round-robin over the
+    /// streaming queues. Each queue is in-order and owns one set of buffers,
+    /// so while one queue uploads chunk N+1 another computes chunk N and a
+    /// third reads back chunk N-1.
+    completion_future LaunchStreamed(const detail::LaunchArgs& Args, ::size_t Chunk)
+    {
+        ThreadState& S = GetThreadState();
+        const ::size_t N = S.StreamQueues.size();
+
+        // Keep the ordering with earlier launches on the main queue
+        std::vector<cl::Event> Start(1);
+        S.Queue.enqueueMarkerWithWaitList(nullptr, &Start[0]);
+
+        std::vector<std::vector<PooledBuffer>> QueueBuffers(N);
+        std::vector<cl::Event> Last(N);
+        for (::size_t First = 0, Index = 0; First < Args.Extent; First += Chunk, ++Index) {
+            ::size_t Q = Index % N;
+            ::size_t Count = std::min(Chunk, Args.Extent - First);
+            EnqueueRange(S.StreamQueues[Q], Args, First, Count, Chunk, QueueBuffers[Q],
+                         Index < N ? &Start : nullptr, &Last[Q]);
+            S.StreamQueues[Q].flush();
+        }
+
+        std::vector<cl::Event> Used(Last.begin(), Last.begin() + std::min(N, (Args.Extent + Chunk - 1) / Chunk));
+        cl::Event Done;
+        S.Queue.enqueueMarkerWithWaitList(&Used, &Done);
+        S.Queue.flush();
+
+        std::vector<PooledBuffer> Buffers;
+        for (std::vector<PooledBuffer>& B : QueueBuffers)
+            std::move(B.begin(), B.end(), std::back_inserter(Buffers));
+        return completion_future(Done, std::move(Buffers));
+    }
+
+    /// Enqueue the upload of elements [First, First+Count) of every input,
+    /// the kernel and the read-back of the output on 'Q'. Buffers of
+    /// 'Capacity' elements are acquired on first use and reused afterwards.
+    void EnqueueRange(cl::CommandQueue& Q, const detail::LaunchArgs& Args,
+                      ::size_t First, ::size_t Count, ::size_t Capacity,
+                      std::vector<PooledBuffer>& Buffers,
+                      const std::vector<cl::Event>* WaitFor, cl::Event* Done)
+    {
+        ThreadState& S = GetThreadState();
+        const std::vector<detail::HostRange>& Inputs = Args.Inputs;
+        const detail::HostRange& Output = Args.Output;
+
+        if (Buffers.empty()) {
+            for (const detail::HostRange& In : Inputs)
+                Buffers.push_back(Pool.Acquire(In.ElementSize * Capacity));
+            Buffers.push_back(Pool.Acquire(Output.ElementSize * Capacity));
+        }
+
+        for (::size_t i = 0; i < Inputs.size(); ++i) {
+            cl::Event Written;
+            Q.enqueueWriteBuffer(Buffers[i].Get(), CL_FALSE, 0, Inputs[i].ElementSize * Count,
+                                 Inputs[i].At(First), i == 0 ? WaitFor : nullptr, Profiled(Written));
+            Record("write", Written, Inputs[i].ElementSize * Count);
+            S.Kernel.setArg(i, Buffers[i].Get());
+        }
+        if (Args.InPlace) {
+            cl::Event Written;
+            Q.enqueueWriteBuffer(Buffers.back().Get(), CL_FALSE, 0, Output.ElementSize * Count,
+                                 Output.At(First), WaitFor, Profiled(Written));
+            Record("write", Written, Output.ElementSize * Count);
+        }
+        S.Kernel.setArg(Inputs.size(), Buffers.back().Get());
+        EnqueueKernel(Q, cl::NDRange(Count));
+        Q.enqueueReadBuffer(Buffers.back().Get(), CL_FALSE, 0, Output.ElementSize * Count,
+                            Output.At(First), nullptr, Done);
+        if (Done)
+            Record("read", *Done, Output.ElementSize * Count);
+    }
+
+    /// Enqueue the current kernel over 'Global' with the tuned local size,
+    /// or, while the kernel is being tuned, time the next candidate. Without
+    /// a tuned size the local range is 'Untuned'.
+    void EnqueueKernel(cl::CommandQueue& Q, const cl::NDRange& Global, const cl::NDRange& Untuned = cl::NullRange)
+    {
+        ThreadState& S = GetThreadState();
+        auto Enqueue = [this, &Q, &S, &Global](const cl::NDRange& Local) {
+            cl::Event Launched;
+            Q.enqueueNDRangeKernel(S.Kernel, cl::NullRange, Global, Local, nullptr, Profiled(Launched));
+            Record("kernel", Launched, 0);
+        };
+        if (!AutoTuning || S.KernelId.empty()) {
+            Enqueue(Untuned);
+            return;
+        }
+
+        // Threads tuning the same kernel take turns with the candidates
+        std::lock_guard<std::recursive_mutex> Guard(Lock);
+        detail::Tuning& T = GetTuning(S.Kernel, S.KernelId);
+        if (T.Done) {
+            Enqueue(GetLocalRange(Global, T.LocalSize));
+            return;
+        }
+
+        // A candidate that does not divide the global size cannot be used for it
+        ::size_t Candidate = T.Candidates[T.Seconds.size()];
+        if (Candidate != 0 && Global[0] % Candidate != 0) {
+            Enqueue(Untuned);
+            T.Seconds.push_back(std::numeric_limits<double>::max());
+        } else {
+            Q.finish();
+            auto Start = std::chrono::steady_clock::now();
+            Enqueue(GetLocalRange(Global, Candidate));
+            Q.finish();
+            T.Seconds.push_back(std::chrono::duration<double>(std::chrono::steady_clock::now() - Start).count());
+        }
+
+        if (T.Seconds.size() == T.Candidates.size()) {
+            T.LocalSize = T.Candidates[std::min_element(T.Seconds.begin(), T.Seconds.end()) - T.Seconds.begin()];
+            T.Done = true;
+            StoreTuning();
+        }
+    }
+
+    /// The tuning state of the current kernel on the current device
+    detail::Tuning& GetTuning(const cl::Kernel& Kernel, const std::string& KernelId)
+    {
+        detail::Tuning& T = Tunings[TuningKey{DeviceId, KernelId}];
+        if (T.Candidates.empty() && !T.Done) {
+            ::size_t Max = Kernel.getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(Device);
+            ::size_t Multiple = Kernel.getWorkGroupInfo<CL_KERNEL_PREFERRED_WORK_GROUP_SIZE_MULTIPLE>(Device);
+            T.Candidates.push_back(0);
+            for (::size_t Size = std::max< ::size_t>(Multiple, 1); Size <= Max; Size *= 2)
+                T.Candidates.push_back(Size);
+        }
+        return T;
+    }
+
+    /// A local range of 'LocalSize' work-items along dimension 0, or the
+    /// driver's choice if 'LocalSize' is 0 or does not divide 'Global'
+    static cl::NDRange GetLocalRange(const cl::NDRange& Global, ::size_t LocalSize)
+    {
+        if (LocalSize == 0 || Global[0] % LocalSize != 0)
+            return cl::NullRange;
+        switch (Global.dimensions()) {
+        case 1: return cl::NDRange(LocalSize);
+        case 2: return cl::NDRange(LocalSize, 1);
+        default: return cl::NDRange(LocalSize, 1, 1);
+        }
+    }
+
+    /// The tuning file has one line per device and kernel:
+    /// device name and driver version, kernel, local size; separated by tabs
+    void LoadTuning()
+    {
+        std::ifstream File(TuningFile);
+        std::string Line;
+        while (std::getline(File, Line)) {
+            std::istringstream Fields(Line);
+            std::string DeviceName, KernelName, LocalSize;
+            if (std::getline(Fields, DeviceName, '\t') && std::getline(Fields, KernelName, '\t') &&
+                    std::getline(Fields, LocalSize)) {
+                detail::Tuning& T = Tunings[TuningKey{DeviceName, KernelName}];
+                T.LocalSize = std::strtoul(LocalSize.c_str(), nullptr, 10);
+                T.Done = true;
+            }
+        }
+    }
+
+    void StoreTuning()
+    {
+        if (TuningFile.empty())
+            return;
+
+        // Write to a temporary file first so that concurrent processes
+        // never read a partially written file
+        std::string TempFileName = TuningFile + "." + std::to_string(getpid());
+        std::ofstream File(TempFileName);
+        for (const auto& Entry : Tunings) {
+            if (Entry.second.Done) {
+                File << std::get<0>(Entry.first) << "\t" << std::get<1>(Entry.first) << "\t"
+                     << Entry.second.LocalSize << "\n";
+            }
+        }
+        File.close();
+        if (File.fail() || std::rename(TempFileName.c_str(), TuningFile.c_str()) != 0)
+            std::remove(TempFileName.c_str());
+    }
+
+    /// The largest power of two work-group size kernel 'K' and the device's
+    /// local memory allow, for kernels using 'LocalBytes' of local memory per
+    /// work-item
+    ::size_t GetGroupSize(const cl::Kernel& K, ::size_t LocalBytes)
+    {
+        ThreadState& S = GetThreadState();
+        ::size_t Limit = K.getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(S.Device);
+        Limit = std::min<cl_ulong>(Limit, S.Limits.LocalMemSize / LocalBytes);
+        ::size_t Size = 1;
+        while (Size * 2 <= Limit)
+            Size *= 2;
+        return Size;
+    }
+
+    /// Number of elements per launch: the configured chunk size, or else the
+    /// largest power of two that keeps every buffer within the device's
+    /// allocation limit and the buffers of all streaming queues within half
+    /// of its global memory.
+    ::size_t GetChunkSize(const detail::LaunchArgs& Args)
+    {
+        if (::size_t Configured = ChunkSize)
+            return Configured;
+
+        ::size_t Largest = Args.Output.ElementSize;
+        ::size_t PerElement = Args.Output.ElementSize;
+        for (const detail::HostRange& In : Args.Inputs) {
+            Largest = std::max(Largest, In.ElementSize);
+            PerElement += In.ElementSize;
+        }
+        const DeviceLimits& L = GetThreadState().Limits;
+        if (Largest * Args.Extent <= L.MaxAllocSize && PerElement * Args.Extent <= L.GlobalMemSize / 2)
+            return Args.Extent;
+
+        cl_ulong Limit = std::min<cl_ulong>(L.MaxAllocSize / Largest,
+                                            L.GlobalMemSize / 2 / (PerElement * StreamQueueCount));
+        ::size_t Chunk = 1;
+        while (Chunk * 2 <= Limit)
+            Chunk *= 2;
+        return Chunk;
+    }
+
+    template <typename KernelResult, ::size_t... I>
+    void SetCaptures(cl_uint FirstIndex, const KernelResult& Result, detail::IndexSequence<I...>)
+    {
+        int Expand[] = {0, (SetCapture(FirstIndex + I, std::get<I + 2>(Result)), 0)...};
+        (void)Expand;
+    }
+
+    template <typename T>
+    void SetCapture(cl_uint Index, const T& Value)
+    {
+        GetThreadState().Kernel.setArg(Index, Value);
+    }
+
+    void SetCapture(cl_uint Index, const detail::CapturedRange& Range)
+    {
+        GetThreadState().Kernel.setArg(Index, GetCaptureBuffer(Range));
+    }
+
+    /// Captured arrays are uploaded once and stay on the device. They are
+    /// looked up by contents, not by address: a lambda capturing by value
+    /// holds a fresh copy each time it is created, and a table captured by
+    /// reference may have been changed since the last launch.
+    cl::Buffer GetCaptureBuffer(const detail::CapturedRange& Range)
+    {
+        std::lock_guard<std::recursive_mutex> Guard(Lock);
+        CaptureKey Key {Range.ByteLength, detail::Hash(Range.Data, Range.ByteLength), Device()};
+        auto It = Captures.find(Key);
+        if (It != Captures.end() && It->second.first.compare(0, std::string::npos,
+                static_cast<const char*>(Range.Data), Range.ByteLength) == 0)
+            return It->second.second;
+
+        if (Captures.size() >= MaxCaptureBuffers)
+            Captures.clear();
+
+        // OpenCL does not allow empty buffers
+        std::string Contents(static_cast<const char*>(Range.Data), Range.ByteLength);
+        Contents.resize(std::max< ::size_t>(Contents.size(), 1));
+        cl::Buffer B(Context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, Contents.size(), &Contents[0]);
+        Contents.resize(Range.ByteLength);
+        Captures[Key] = std::make_pair(Contents, B);
+        return B;
+    }
+
+    cl::Program BuildProgram(const std::string& KernelCode)
+    {
+        // The binary cache holds one binary per program
+        std::string BinaryFileName;
+        if (!BinaryCacheDir.empty() && SelectedDevices.size() == 1) {
+            BinaryFileName = GetBinaryFileName(KernelCode);
+            cl::Program P;
+            if (LoadBinary(BinaryFileName, P)) {
+                ++CacheStats.BinaryHits;
+                return P;
+            }
+            ++CacheStats.BinaryMisses;
+        }
+
+        cl::Program::Sources Sources;
+        Sources.push_back({KernelCode.c_str(),KernelCode.length()});
+        cl::Program P(Context,Sources);
+        Program = P;
+        P.build(SelectedDevices, Options.c_str());
+
+        if (!BinaryFileName.empty())
+            StoreBinary(BinaryFileName, P);
+        return P;
+    }
+
+    /// The binary cache key covers everything that may change the generated
+    /// binary: the source, the build options, the device and its driver.
+    std::string GetBinaryFileName(const std::string& KernelCode)
+    {
+        unsigned long long H = detail::Hash(KernelCode);
+        H = detail::Hash(Options, H);
+        H = detail::Hash(Platform.getInfo<CL_PLATFORM_VERSION>(), H);
+        H = detail::Hash(Device.getInfo<CL_DEVICE_NAME>(), H);
+        H = detail::Hash(Device.getInfo<CL_DEVICE_VERSION>(), H);
+        H = detail::Hash(Device.getInfo<CL_DRIVER_VERSION>(), H);
+
+        std::ostringstream Name;
+        Name << BinaryCacheDir << "/" << std::hex << H << ".bin";
+        return Name.str();
+    }
+
+    bool LoadBinary(const std::string& FileName, cl::Program& P)
+    {
+        std::ifstream BinaryFile(FileName, std::ios::binary);
+        if (BinaryFile.fail())
+            return false;
+        std::string Binary(
+            std::istreambuf_iterator<char>(BinaryFile),
+            (std::istreambuf_iterator<char>()));
+        if (Binary.empty())
+            return false;
+
+        try {
+            cl::Program::Binaries Binaries;
+            Binaries.push_back({Binary.data(), Binary.size()});
+            P = cl::Program(Context, {Device}, Binaries);
+            P.build({Device}, Options.c_str());
+        } catch(cl::Error&) {
+            // A stale or corrupt binary; rebuild from source and overwrite it
+            return false;
+        }
+        return true;
+    }
+
+    void StoreBinary(const std::string& FileName, const cl::Program& P)
+    {
+        try {
+            VECTOR_CLASS< ::size_t> Sizes = P.getInfo<CL_PROGRAM_BINARY_SIZES>();
+            VECTOR_CLASS<char*> Binaries = P.getInfo<CL_PROGRAM_BINARIES>();
+            if (Sizes.size() == 1 && Sizes[0] != 0) {
+                mkdir(BinaryCacheDir.c_str(), 0755);
+                // Write to a temporary file first so that concurrent processes
+                // never load a partially written binary
+                std::string TempFileName = FileName + "." + std::to_string(getpid());
+                std::ofstream BinaryFile(TempFileName, std::ios::binary);
+                BinaryFile.write(Binaries[0], Sizes[0]);
+                BinaryFile.close();
+                if (BinaryFile.fail() || std::rename(TempFileName.c_str(), FileName.c_str()) != 0)
+                    std::remove(TempFileName.c_str());
+            }
+            for (char* Binary : Binaries)
+                delete[] Binary;
+        } catch(cl::Error& e) {
+            std::cerr << e.what() << ": " << e.err() << "\n";
+        }
+    }
+
+    cl::Program LoadProgram(const std::string& FileName)
+    {
+        ProgramKey Key {FileName, Options, Device()};
+        auto It = Programs.find(Key);
+        if (It != Programs.end())
+            return It->second;
+
+        // The source is embedded in the program by cpp_opencl. The file is
+        // read only for sources that are not, e.g. ones written by hand.
+        std::string KernelCode;
+        auto Embedded = detail::EmbeddedSources().find(FileName);
+        if (Embedded != detail::EmbeddedSources().end()) {
+            KernelCode = Embedded->second;
+        } else {
+            std::ifstream SourceFile(FileName);
+            if(SourceFile.fail())
+                throw std::runtime_error("Failed to open OpenCL source file.");
+            KernelCode.assign(
+                std::istreambuf_iterator<char>(SourceFile),
+                (std::istreambuf_iterator<char>()));
+        }
+
+        cl::Program P = BuildProgram(KernelCode);
+        Programs[Key] = P;
+        return P;
+    }
+
+    void PrintBuildLog(const cl::Program& P)
+    {
+        if (!P()) return;
+        std::cerr << "Build Status: " << P.getBuildInfo<CL_PROGRAM_BUILD_STATUS>(Device) << std::endl;
+        std::cerr << "Build Options:\t" << P.getBuildInfo<CL_PROGRAM_BUILD_OPTIONS>(Device) << std::endl;
+        std::cerr << "Build Log:\t " << P.getBuildInfo<CL_PROGRAM_BUILD_LOG>(Device) << std::endl;
+    }
+
+private:
+    // (source file, build options, device)
+    typedef std::tuple<std::string, std::string, cl_device_id> ProgramKey;
+    // (source file, kernel name, build options, device)
+    typedef std::tuple<std::string, std::string, std::string, cl_device_id> KernelKey;
+    // (size, hash of the contents, device)
+    typedef std::tuple< ::size_t, unsigned long long, cl_device_id> CaptureKey;
+    // (device name and driver version, source file:kernel name)
+    typedef std::tuple<std::string, std::string> TuningKey;
+
+    /// The limits of the selected device (the first one of several)
+    struct DeviceLimits
+    {
+        cl_ulong MaxAllocSize;
+        cl_ulong GlobalMemSize;
+        cl_bool HostUnifiedMemory;
+        cl_uint BaseAddressAlign;
+        cl_ulong LocalMemSize;
+    };
+
+    /// The current kernel and the command queues of one thread. Kernel
+    /// objects are per thread as well, since their arguments are set on
+    /// every launch.
+    struct ThreadState
+    {
+        ThreadState() : DevicesGeneration{0}, KernelsGeneration{0}, OptionsGeneration{0}, Limits(), Profiling{false} {}
+
+        unsigned DevicesGeneration;
+        unsigned KernelsGeneration;
+        unsigned OptionsGeneration;
+        // Copy of the build options, taken under the lock when they change
+        std::string Options;
+        // Copies of the device and its limits, taken under the lock when
+        // the devices change, so that launches need not lock to read them
+        cl::Device Device;
+        DeviceLimits Limits;
+        cl::Kernel Kernel;
+        std::string KernelId;
+        std::map<KernelKey, cl::Kernel> Kernels;
+        cl::CommandQueue Queue;
+        std::vector<cl::CommandQueue> StreamQueues;
+        // Whether Queue and StreamQueues were created for profiling
+        bool Profiling;
+        // One queue per selected device when launches are split across devices
+        std::vector<cl::CommandQueue> DeviceQueues;
+        std::vector<detail::Partition> Partitions;
+    };
+
+    /// The state of the calling thread, brought up to date with the
+    /// selected devices and the kernel cache
+    ThreadState& GetThreadState()
+    {
+        ThreadState& S = GetCurrentThreadState();
+        if (S.OptionsGeneration != OptionsGeneration) {
+            std::lock_guard<std::recursive_mutex> Guard(Lock);
+            S.Options = Options;
+            S.OptionsGeneration = OptionsGeneration;
+        }
+        if (S.KernelsGeneration != KernelsGeneration) {
+            S.Kernels.clear();
+            S.Kernel = cl::Kernel();
+            S.KernelId.clear();
+            S.KernelsGeneration = KernelsGeneration;
+        }
+        if (S.DevicesGeneration != DevicesGeneration) {
+            std::lock_guard<std::recursive_mutex> Guard(Lock);
+            S.Device = Device;
+            S.Limits = Limits;
+            S.Profiling = Profiling;
+            cl_command_queue_properties Properties = Profiling ? CL_QUEUE_PROFILING_ENABLE : 0;
+            S.Queue = cl::CommandQueue(Context, Device, Properties);
+            S.StreamQueues.clear();
+            for (int i = 0; i < StreamQueueCount; ++i)
+                S.StreamQueues.push_back(cl::CommandQueue(Context, Device, Properties));
+            // Profiling is needed to measure the throughput of each device
+            S.DeviceQueues.clear();
+            S.Partitions.clear();
+            if (SelectedDevices.size() > 1) {
+                for (const cl::Device& D : SelectedDevices)
+                    S.DeviceQueues.push_back(cl::CommandQueue(Context, D, CL_QUEUE_PROFILING_ENABLE));
+            }
+            S.DevicesGeneration = DevicesGeneration;
+        }
+        return S;
+    }
+
+    /// The state of the calling thread as the current launch found it
+    static ThreadState& GetCurrentThreadState()
+    {
+        static thread_local ThreadState S;
+        return S;
+    }
+
+    VECTOR_CLASS<cl::Device>* Devices;
+    cl::Platform Platform;
+    cl::Device Device;
+    VECTOR_CLASS<cl::Device> SelectedDevices;
+    cl::Context Context;
+    cl::Program Program;
+    cl::Program::Sources Sources;
+
+    // Guards the caches, the tuning state and the device weights shared by
+    // all threads
+    mutable std::recursive_mutex Lock;
+    std::atomic<unsigned> DevicesGeneration;
+    std::atomic<unsigned> KernelsGeneration;
+    std::atomic<unsigned> OptionsGeneration;
+
+    std::string Options;
+    std::map<ProgramKey, cl::Program> Programs;
+    // Bumped without the lock, by kernel cache hits
+    struct CacheCounters
+    {
+        CacheCounters() : Hits{0}, Misses{0}, BinaryHits{0}, BinaryMisses{0} {}
+
+        std::atomic< ::size_t> Hits;
+        std::atomic< ::size_t> Misses;
+        std::atomic< ::size_t> BinaryHits;
+        std::atomic< ::size_t> BinaryMisses;
+    };
+    CacheCounters CacheStats;
+    LaunchStats Launches;
+    std::string BinaryCacheDir;
+    BufferPool Pool;
+
+    static const ::size_t MaxCaptureBuffers = 64;
+    // Host copy of the contents, to rule out hash collisions, and the buffer
+    std::map<CaptureKey, std::pair<std::string, cl::Buffer>> Captures;
+
+    // Triple buffering: upload, compute and read-back of three chunks overlap
+    static const int StreamQueueCount = 3;
+    DeviceLimits Limits;
+    std::atomic< ::size_t> ChunkSize;
+
+    std::vector<double> DeviceWeights;
+    bool MeasureWeights;
+
+    std::atomic<bool> ZeroCopy;
+
+    std::atomic<bool> AutoTuning;
+    std::string TuningFile;
+    std::map<TuningKey, detail::Tuning> Tunings;
+    // Identifies the device across runs
+    std::string DeviceId;
+
+    static const ::size_t DefaultHostThreshold = 4096;
+    std::atomic< ::size_t> HostThreshold;
+    double LaunchOverhead;
+    // Keyed by source file:kernel name
+    std::map<std::string, detail::HostCost> HostCosts;
+
+    static const ::size_t MaxPendingProfile = 4096;
+    bool Profiling;
+    std::string ProfileFile;
+    std::vector<detail::ProfileRecord> PendingProfile;
+    std::vector<ProfileEntry> ProfileEntries;
+    // Queues numbered in the order they first appear
+    std::map<cl_command_queue, ::size_t> ProfileQueues;
+};
+
+
+namespace detail {
+
+/// Lambdas without a host copy always run on the device
+template <typename InputIterator, typename Iterators, typename KernelType, ::size_t... Inputs>
+bool RunOnHost(InputIterator, InputIterator, const Iterators&, const KernelType&, IndexSequence<Inputs...>)
+{
+    return false;
+}
+
+/// Run the host copy of the lambda on the thread pool if the range is too
+/// small for the device or there is no device. 'Its' holds the further
+/// input iterators, whose indexes are 'Inputs', followed by the output.
+template <typename InputIterator, typename Iterators, typename KernelType, typename HostType, ::size_t... Inputs>
+bool RunOnHost(InputIterator begin, InputIterator end, const Iterators& Its,
+               const HostKernel<KernelType, HostType>& F, IndexSequence<Inputs...>)
+{
+    ::size_t Extent = std::distance(begin, end);
+    auto Result = F(typename std::iterator_traits<InputIterator>::value_type(),
+        typename std::iterator_traits<typename std::tuple_element<Inputs, Iterators>::type>::value_type()...);
+    Accelerator& K = Accelerator::Instance();
+    if (!K.UseHost(std::get<0>(Result), std::get<1>(Result), Extent))
+        return false;
+
+    auto output = std::get<sizeof...(Inputs)>(Its);
+    auto Start = std::chrono::steady_clock::now();
+    ThreadPool& Pool = ThreadPool::Instance();
+    ::size_t Grain = std::max< ::size_t>(Extent / (8 * (Pool.GetThreadCount() + 1)), 256);
+    Pool.ParallelFor(Extent, Grain, [&](::size_t First, ::size_t Last) {
+        for (::size_t i = First; i < Last; ++i)
+            *(output + i) = F.Host(*(begin + i), *(std::get<Inputs>(Its) + i)...);
+    });
+    K.AddHostTime(std::get<0>(Result), std::get<1>(Result), Extent,
+                  std::chrono::duration<double>(std::chrono::steady_clock::now() - Start).count());
+    return true;
+}
+
+} // namespace detail
+
+/// Like parallel_for_each, but returns as soon as the work is enqueued.
+/// The ranges must stay valid until the returned future is ready. Ranges
+/// run on the host are done when it returns.
+template <typename InputIterator, typename OutputIterator, typename KernelType>
+completion_future parallel_for_each_async(InputIterator begin, InputIterator end, OutputIterator output, const KernelType& F)
+{
+    // The rewritten lambda returns the source file and kernel name, followed
+    // by its captures if it has any. It is probed with an element of any
+    // type, not only one constructible from 0.
+    auto Result = F(typename std::iterator_traits<InputIterator>::value_type());
+    const std::string& FileName = std::get<0>(Result);
+    const std::string& KernelName = std::get<1>(Result);
+
+    if (detail::RunOnHost(begin, end, std::make_tuple(output), F, detail::IndexSequence<>()))
+        return completion_future();
+
+    Accelerator& K = Accelerator::Instance();
+    if (begin != end && detail::Aliases(begin, output)) {
+        std::string InPlaceName = KernelName + "_inplace";
+        if (K.HasKernel(FileName, InPlaceName)) {
+            K.LoadKernel(FileName, InPlaceName);
+            K.SetCaptures(1, Result);
+            return K.RunInPlaceAsync(begin, end);
+        }
+    }
+
+    K.LoadKernel(FileName, KernelName);
+    K.SetCaptures(2, Result);
+    return K.RunAsync(begin, end, output);
+}
+
+namespace detail {
+
+// 'Args' holds the iterators following 'begin' and 'end' (the further inputs
+// and the output) and then the kernel
+template <typename InputIterator, typename... Rest, ::size_t... Inputs, ::size_t... Iterators>
+completion_future ZipAsync(InputIterator begin, InputIterator end, const std::tuple<Rest...>& Args,
+                           IndexSequence<Inputs...>, IndexSequence<Iterators...>)
+{
+    typedef typename std::tuple_element<sizeof...(Rest)-1, std::tuple<Rest...>>::type KernelType;
+    const KernelType& F = std::get<sizeof...(Rest)-1>(Args);
+    auto Result = F(
+        typename std::iterator_traits<InputIterator>::value_type(),
+        typename std::iterator_traits<typename std::tuple_element<Inputs, std::tuple<Rest...>>::type>::value_type()...);
+
+    if (RunOnHost(begin, end, Args, F, IndexSequence<Inputs...>()))
+        return completion_future();
+
+    // Kernel arguments: every input, the output and then the captures
+    Accelerator& K = Accelerator::Instance();
+    K.LoadKernel(std::get<0>(Result), std::get<1>(Result));
+    K.SetCaptures(sizeof...(Inputs) + 2, Result);
+    return K.RunAsync(begin, end, std::get<Iterators>(Args)...);
+}
+
+} // namespace detail
+
+/// parallel_for_each over several input ranges of equal length: element i of
+/// the output is F(in1[i], in2[i], ...). The lambda takes one parameter per
+/// input range and the kernel one buffer per input range, so no packing into
+/// structs is needed on the host.
+template <typename InputIterator, typename InputIterator2, typename... Rest>
+completion_future parallel_for_each_async(InputIterator begin, InputIterator end, InputIterator2 input2, Rest... rest)
+{
+    static_assert(sizeof...(Rest) >= 2, "parallel_for_each needs an output iterator and a kernel");
+
+    std::tuple<InputIterator2, Rest...> Args(input2, rest...);
+    return detail::ZipAsync(begin, end, Args,
+                            typename detail::MakeIndexSequence<sizeof...(Rest)-1>::type(),
+                            typename detail::MakeIndexSequence<sizeof...(Rest)>::type());
+}
+
+/// Combine 'init' and the elements of [begin, end) with the binary lambda
+/// 'F' on the device. As with std::reduce, 'F' must be associative and
+/// commutative, since the elements are combined in no particular order.
+template <typename InputIterator, typename T, typename KernelType>
+T reduce(InputIterator begin, InputIterator end, T init, const KernelType& F)
+{
+    typedef typename std::iterator_traits<InputIterator>::value_type value_type;
+    auto Result = F(value_type(), value_type());
+
+    // Kernel arguments: input, partial results, local memory, size and then the captures
+    Accelerator& K = Accelerator::Instance();
+    K.LoadKernel(std::get<0>(Result), std::get<1>(Result));
+    K.SetCaptures(4, Result);
+    return K.Reduce(begin, end, init);
+}
+
+/// Call the lambda 'F' once for every index of the N dimensional 'Extent' on
+/// the device and write its result to the row-major 'output':
+///
+///   compute::parallel_for(compute::extent<2>{Rows, Cols}, Out.begin(), [](compute::index<2> idx) {
+///       return idx[0] * idx[1];
+///   });
+///
+/// Each work-item gets its index from get_global_id, so no index is
+/// recomputed from a flattened one.
+template <int N, typename OutputIterator, typename KernelType>
+completion_future parallel_for_async(const extent<N>& Extent, OutputIterator output, const KernelType& F)
+{
+    auto Result = F(index<N>());
+
+    // Kernel arguments: the output and then the captures
+    Accelerator& K = Accelerator::Instance();
+    K.LoadKernel(std::get<0>(Result), std::get<1>(Result));
+    K.SetCaptures(1, Result);
+    return K.RunAsync(Extent, output);
+}
+
+template <int N, typename OutputIterator, typename KernelType>
+void parallel_for(const extent<N>& Extent, OutputIterator output, const KernelType& F)
+{
+    parallel_for_async(Extent, output, F).wait();
+}
+
+/// Inclusive prefix scan of [begin, end) into 'output' with the binary lambda
+/// 'F', which must be associative. Like std::inclusive_scan, returns the end
+/// of the output range.
+template <typename InputIterator, typename OutputIterator, typename KernelType>
+OutputIterator inclusive_scan(InputIterator begin, InputIterator end, OutputIterator output, const KernelType& F)
+{
+    typedef typename std::iterator_traits<InputIterator>::value_type value_type;
+    auto Result = F(value_type(), value_type());
+
+    Accelerator::Instance().Scan(begin, end, output, Result, static_cast<const value_type*>(nullptr));
+    return output + std::distance(begin, end);
+}
+
+/// Exclusive prefix scan: output[i] is 'init' combined with the elements
+/// before begin[i]
+template <typename InputIterator, typename OutputIterator, typename T, typename KernelType>
+OutputIterator exclusive_scan(InputIterator begin, InputIterator end, OutputIterator output, T init, const KernelType& F)
+{
+    typedef typename std::iterator_traits<InputIterator>::value_type value_type;
+    auto Result = F(value_type(), value_type());
+
+    value_type Init = init;
+    Accelerator::Instance().Scan(begin, end, output, Result, &Init);
+    return output + std::distance(begin, end);
+}
+
+template <typename InputIterator, typename OutputIterator, typename KernelType>
+void parallel_for_each(InputIterator begin, InputIterator end, OutputIterator output, const KernelType& F)
+{
+    parallel_for_each_async(begin, end, output, F).wait();
+}
+
+template <typename InputIterator, typename InputIterator2, typename... Rest>
+void parallel_for_each(InputIterator begin, InputIterator end, InputIterator2 input2, Rest... rest)
+{
+    parallel_for_each_async(begin, end, input2, rest...).wait();
+}
+
+namespace detail {
+
+template <typename InputIterator, typename... Stages>
+struct Pipeline
+{
+    InputIterator Begin;
+    InputIterator End;
+    std::tuple<Stages...> Kernels;
+};
+
+template <typename KernelType>
+struct MapStage
+{
+    KernelType Kernel;
+};
+
+template <typename OutputIterator>
+struct IntoStage
+{
+    OutputIterator Output;
+};
+
+/// The captures returned by a rewritten kernel lambda, i.e. the elements of
+/// 'Result' following the source file and kernel name
+template <typename KernelResult, ::size_t... I>
+auto GetCaptures(const KernelResult& Result, IndexSequence<I...>)
+    -> decltype(std::make_tuple(std::get<I + 2>(Result)...))
+{
+    return std::make_tuple(std::get<I + 2>(Result)...);
+}
+
+template <typename KernelResult>
+auto GetCaptures(const KernelResult& Result)
+    -> decltype(GetCaptures(Result, typename MakeIndexSequence<std::tuple_size<KernelResult>::value - 2>::type()))
+{
+    return GetCaptures(Result, typename MakeIndexSequence<std::tuple_size<KernelResult>::value - 2>::type());
+}
+
+/// Combine the results of the rewritten lambdas of the stages of a pipeline
+/// into the result of its kernel: the source file, the name of the fused
+/// kernel, which the compiler names after the stages (_Kernel_1_2 for the
+/// stages _Kernel_1 and _Kernel_2), and the captures of every stage in turn
+template <typename Results, ::size_t... I>
+auto FuseResults(const Results& R, IndexSequence<I...>)
+    -> decltype(std::tuple_cat(std::make_tuple(std::string(), std::string()), GetCaptures(std::get<I>(R))...))
+{
+    static const ::size_t PrefixLength = sizeof("_Kernel") - 1;
+    std::string Names[] = {std::get<1>(std::get<I>(R))...};
+    std::string KernelName = Names[0];
+    for (::size_t i = 1; i < sizeof...(I); ++i)
+        KernelName += Names[i].substr(PrefixLength);
+    return std::tuple_cat(std::make_tuple(std::string(std::get<0>(std::get<0>(R))), KernelName),
+                          GetCaptures(std::get<I>(R))...);
+}
+
+/// The argument the rewritten lambda of a stage is called with to get its
+/// result. The stages of a pipeline take different element types, and a
+/// rewritten lambda does not use its argument.
+struct AnyElement
+{
+    template <typename T>
+    operator T() const { return T(); }
+};
+
+template <typename... Stages, ::size_t... I>
+auto Fuse(const std::tuple<Stages...>& Kernels, IndexSequence<I...> Sequence)
+    -> decltype(FuseResults(std::make_tuple(std::get<I>(Kernels)(AnyElement())...), Sequence))
+{
+    return FuseResults(std::make_tuple(std::get<I>(Kernels)(AnyElement())...), Sequence);
+}
+
+/// The rewritten lambdas of the stages of a pipeline, which together name
+/// the pipeline's kernel
+template <typename... Stages>
+struct FusedKernel
+{
+    std::tuple<Stages...> Kernels;
+
+    template <typename... Args>
+    auto operator()(Args...) const
+        -> decltype(Fuse(std::declval<const std::tuple<Stages...>&>(),
+                         typename MakeIndexSequence<sizeof...(Stages)>::type()))
+    {
+        return Fuse(Kernels, typename MakeIndexSequence<sizeof...(Stages)>::type());
+    }
+};
+
+/// Call the host copies of the stages I to N of a pipeline in turn
+template < ::size_t I, ::size_t N>
+struct ComposeHost
+{
+    template <typename Stages, typename T>
+    static auto Call(const Stages& Kernels, const T& Value)
+        -> decltype(ComposeHost<I + 1, N>::Call(Kernels, std::get<I>(Kernels).Host(Value)))
+    {
+        return ComposeHost<I + 1, N>::Call(Kernels, std::get<I>(Kernels).Host(Value));
+    }
+};
+
+template < ::size_t N>
+struct ComposeHost<N, N>
+{
+    template <typename Stages, typename T>
+    static T Call(const Stages&, const T& Value) { return Value; }
+};
+
+template <typename... Stages>
+struct FusedHost
+{
+    std::tuple<Stages...> Kernels;
+
+    template <typename T>
+    auto operator()(const T& Value) const
+        -> decltype(ComposeHost<0, sizeof...(Stages)>::Call(std::declval<const std::tuple<Stages...>&>(), Value))
+    {
+        return ComposeHost<0, sizeof...(Stages)>::Call(Kernels, Value);
+    }
+};
+
+template <typename T> struct IsHostKernel : std::false_type {};
+template <typename KernelType, typename HostType>
+struct IsHostKernel<HostKernel<KernelType, HostType>> : std::true_type {};
+
+template <typename... Stages> struct AllHostKernels : std::true_type {};
+template <typename Stage, typename... Rest>
+struct AllHostKernels<Stage, Rest...> :
+    std::integral_constant<bool, IsHostKernel<Stage>::value && AllHostKernels<Rest...>::value> {};
+
+/// A pipeline has a host copy if all of its stages have one
+template <typename... Stages>
+FusedKernel<Stages...> MakeFusedKernel(const std::tuple<Stages...>& Kernels, std::false_type)
+{
+    return FusedKernel<Stages...>{Kernels};
+}
+
+template <typename... Stages>
+HostKernel<FusedKernel<Stages...>, FusedHost<Stages...>> MakeFusedKernel(const std::tuple<Stages...>& Kernels,
+                                                                         std::true_type)
+{
+    return WithHost(FusedKernel<Stages...>{Kernels}, FusedHost<Stages...>{Kernels});
+}
+
+} // namespace detail
+
+/// Element-wise steps over [begin, end) that run as a single kernel:
+///
+///   compute::pipeline(In.begin(), In.end())
+///       | compute::map([](int x) { return x * x; })
+///       | compute::map([Scale](int x) { return x * Scale; })
+///       | compute::into(Out.begin());
+///
+/// The compiler fuses the lambdas of the stages into one kernel, so the
+/// intermediate results stay in registers instead of going through device
+/// buffers and host memory. It only sees a pipeline written as a single
+/// expression ending in compute::into, which runs it and waits for it.
+template <typename InputIterator>
+detail::Pipeline<InputIterator> pipeline(InputIterator begin, InputIterator end)
+{
+    return detail::Pipeline<InputIterator>{begin, end, std::tuple<>()};
+}
+
+template <typename KernelType>
+detail::MapStage<KernelType> map(const KernelType& F)
+{
+    return detail::MapStage<KernelType>{F};
+}
+
+template <typename OutputIterator>
+detail::IntoStage<OutputIterator> into(OutputIterator output)
+{
+    return detail::IntoStage<OutputIterator>{output};
+}
+
+namespace detail {
+
+// The operators of a pipeline are found by argument-dependent lookup
+template <typename InputIterator, typename... Stages, typename KernelType>
+Pipeline<InputIterator, Stages..., KernelType>
+operator|(const Pipeline<InputIterator, Stages...>& P, const MapStage<KernelType>& Stage)
+{
+    return Pipeline<InputIterator, Stages..., KernelType>{
+        P.Begin, P.End, std::tuple_cat(P.Kernels, std::make_tuple(Stage.Kernel))};
+}
+
+template <typename InputIterator, typename... Stages, typename OutputIterator>
+void operator|(const Pipeline<InputIterator, Stages...>& P, const IntoStage<OutputIterator>& Into)
+{
+    static_assert(sizeof...(Stages) > 0, "a pipeline needs at least one compute::map stage");
+    parallel_for_each(P.Begin, P.End, Into.Output,
+                      MakeFusedKernel(P.Kernels, AllHostKernels<Stages...>()));
+}
+
+} // namespace detail
 
 
 } // namespace compute
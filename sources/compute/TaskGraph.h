@@ -0,0 +1,225 @@
+#ifndef TaskGraph_H
+#define TaskGraph_H
+
+#include "ParallelForEach.h"
+
+#include <exception>
+#include <functional>
+#include <initializer_list>
+#include <thread>
+
+namespace compute {
+
+
+/// Transfers, kernel launches and host callbacks with explicit
+/// dependencies. Every task is enqueued as soon as it is added, waiting only
+/// for the events of the tasks it depends on, so independent kernels and
+/// transfers overlap:
+///
+///   compute::TaskGraph G;
+///   cl::Buffer A = G.CreateBuffer(N * sizeof(int));
+///   cl::Buffer B = G.CreateBuffer(N * sizeof(int));
+///   auto Upload = G.Write(A, In.begin(), In.end());
+///   auto Square = G.Launch("kernels.cl", "square", cl::NDRange(N), {Upload}, A, B);
+///   G.Read(B, Out.begin(), Out.end(), {Square});
+///   G.Wait();
+///
+/// Tasks run on an out-of-order queue where the device supports one, and
+/// otherwise spread over several in-order queues. Host callbacks run on a
+/// thread of their own once their dependencies are complete.
+class TaskGraph
+{
+public:
+    typedef ::size_t Task;
+    typedef std::initializer_list<Task> Dependencies;
+
+    explicit TaskGraph(Accelerator& A = Accelerator::Instance()) :
+        TheAccelerator(A), NextQueue{0}, Waited{0}
+    {
+        cl::Device Device = A.GetDevice();
+        if (Device.getInfo<CL_DEVICE_QUEUE_PROPERTIES>() & CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE) {
+            Queues.push_back(cl::CommandQueue(A.GetContext(), Device, CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE));
+        } else {
+            for (int i = 0; i < InOrderQueueCount; ++i)
+                Queues.push_back(cl::CommandQueue(A.GetContext(), Device));
+        }
+    }
+
+    TaskGraph(const TaskGraph& that) = delete;
+    TaskGraph& operator=(TaskGraph&) = delete;
+
+    ~TaskGraph()
+    {
+        try {
+            Wait();
+        } catch(cl::Error& e) {
+            std::cerr << e.what() << ": " << e.err() << "\n";
+        } catch(std::exception& e) {
+            std::cerr << e.what() << "\n";
+        }
+    }
+
+    /// A device buffer that lives as long as the graph
+    cl::Buffer CreateBuffer(::size_t ByteLength)
+    {
+        Buffers.push_back(TheAccelerator.GetBufferPool().Acquire(ByteLength));
+        return Buffers.back().Get();
+    }
+
+    /// Copy [begin, end) to the start of 'B'
+    template <typename Iterator>
+    Task Write(const cl::Buffer& B, Iterator begin, Iterator end, Dependencies After = {})
+    {
+        detail::HostRange Range = detail::MakeHostRange(begin);
+        std::vector<cl::Event> WaitFor = GetEvents(After);
+        cl::Event Done;
+        GetNextQueue().enqueueWriteBuffer(B, CL_FALSE, 0, Range.ElementSize * std::distance(begin, end), Range.Data,
+                                          WaitFor.empty() ? nullptr : &WaitFor, &Done);
+        return AddTask(Done);
+    }
+
+    /// Copy the start of 'B' to [begin, end)
+    template <typename Iterator>
+    Task Read(const cl::Buffer& B, Iterator begin, Iterator end, Dependencies After = {})
+    {
+        detail::HostRange Range = detail::MakeHostRange(begin);
+        std::vector<cl::Event> WaitFor = GetEvents(After);
+        cl::Event Done;
+        GetNextQueue().enqueueReadBuffer(B, CL_FALSE, 0, Range.ElementSize * std::distance(begin, end), Range.Data,
+                                         WaitFor.empty() ? nullptr : &WaitFor, &Done);
+        return AddTask(Done);
+    }
+
+    Task Copy(const cl::Buffer& From, const cl::Buffer& To, ::size_t ByteLength, Dependencies After = {})
+    {
+        std::vector<cl::Event> WaitFor = GetEvents(After);
+        cl::Event Done;
+        GetNextQueue().enqueueCopyBuffer(From, To, 0, 0, ByteLength, WaitFor.empty() ? nullptr : &WaitFor, &Done);
+        return AddTask(Done);
+    }
+
+    /// Launch kernel 'KernelName' of the OpenCL source file 'FileName' over
+    /// 'Global' with the arguments 'args': buffers, scalars or cl::Local
+    template <typename... Args>
+    Task Launch(const std::string& FileName, const std::string& KernelName, const cl::NDRange& Global,
+                Dependencies After, const Args&... args)
+    {
+        // A kernel object per launch, so the arguments of launches that are
+        // still pending are never changed
+        cl::Kernel Kernel = TheAccelerator.CreateKernel(FileName, KernelName);
+        SetArgs(Kernel, 0, args...);
+
+        std::vector<cl::Event> WaitFor = GetEvents(After);
+        cl::Event Done;
+        GetNextQueue().enqueueNDRangeKernel(Kernel, cl::NullRange, Global, cl::NullRange,
+                                            WaitFor.empty() ? nullptr : &WaitFor, &Done);
+        return AddTask(Done);
+    }
+
+    /// Call 'F' on the host once the tasks 'After' are complete. Tasks that
+    /// depend on it wait for it like for any other task.
+    Task Host(std::function<void()> F, Dependencies After = {})
+    {
+        std::vector<cl::Event> WaitFor = GetEvents(After);
+        cl::UserEvent Done(TheAccelerator.GetContext());
+
+        // The device tasks it waits for must be submitted
+        for (cl::CommandQueue& Q : Queues)
+            Q.flush();
+        HostThreads.push_back(std::thread([this, F, WaitFor, Done]() mutable {
+            cl_int Status = CL_COMPLETE;
+            try {
+                if (!WaitFor.empty())
+                    cl::WaitForEvents(WaitFor);
+                F();
+            } catch(...) {
+                std::lock_guard<std::mutex> Guard(Lock);
+                if (!Error)
+                    Error = std::current_exception();
+                Status = -1;
+            }
+            Done.setStatus(Status);
+        }));
+        return AddTask(Done);
+    }
+
+    /// The event that completes with task 'T', e.g. for use in an OpenCL
+    /// wait list
+    const cl::Event& GetEvent(Task T) const { return Events[T]; }
+
+    /// Block until every task is complete. An exception thrown by a host
+    /// callback is thrown again here.
+    void Wait()
+    {
+        for (cl::CommandQueue& Q : Queues)
+            Q.flush();
+        for (std::thread& T : HostThreads)
+            T.join();
+        HostThreads.clear();
+
+        // A failed host callback fails the tasks depending on it, so the
+        // events are waited for one at a time: the device must be done with
+        // every buffer before the callback's exception is thrown again
+        std::exception_ptr E;
+        std::swap(E, Error);
+        for (; Waited < Events.size(); ++Waited) {
+            try {
+                Events[Waited].wait();
+            } catch(cl::Error&) {
+                if (!E)
+                    E = std::current_exception();
+            }
+        }
+        if (E)
+            std::rethrow_exception(E);
+    }
+
+private:
+    static void SetArgs(cl::Kernel&, cl_uint) {}
+
+    template <typename T, typename... Rest>
+    static void SetArgs(cl::Kernel& Kernel, cl_uint Index, const T& Arg, const Rest&... rest)
+    {
+        Kernel.setArg(Index, Arg);
+        SetArgs(Kernel, Index + 1, rest...);
+    }
+
+    Task AddTask(const cl::Event& Done)
+    {
+        Events.push_back(Done);
+        return Events.size() - 1;
+    }
+
+    std::vector<cl::Event> GetEvents(Dependencies After) const
+    {
+        std::vector<cl::Event> WaitFor;
+        for (Task T : After)
+            WaitFor.push_back(Events.at(T));
+        return WaitFor;
+    }
+
+    cl::CommandQueue& GetNextQueue()
+    {
+        cl::CommandQueue& Q = Queues[NextQueue];
+        NextQueue = (NextQueue + 1) % Queues.size();
+        return Q;
+    }
+
+    static const int InOrderQueueCount = 3;
+
+    Accelerator& TheAccelerator;
+    std::vector<cl::CommandQueue> Queues;
+    ::size_t NextQueue;
+    std::vector<cl::Event> Events;
+    // The tasks before this one are complete
+    ::size_t Waited;
+    std::vector<PooledBuffer> Buffers;
+    std::vector<std::thread> HostThreads;
+    std::mutex Lock;
+    std::exception_ptr Error;
+};
+
+
+} // namespace compute
+
+#endif
@@ -0,0 +1,194 @@
+#ifndef ThreadPool_H
+#define ThreadPool_H
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace compute {
+
+
+/// A work-stealing pool of host threads. Every worker has its own deque of
+/// tasks: it works on the newest task of its own deque and, once that is
+/// empty, steals the oldest task of another one. Threads outside the pool
+/// submit to a deque of their own and help with the work while they wait.
+class ThreadPool
+{
+public:
+    explicit ThreadPool(unsigned ThreadCount = std::thread::hardware_concurrency()) :
+        Queues(std::max(ThreadCount, 1u) + 1), Pending{0}, Stop{false}
+    {
+        for (auto& Q : Queues)
+            Q.reset(new TaskQueue);
+        for (unsigned i = 0; i + 1 < Queues.size(); ++i)
+            Workers.push_back(std::thread([this, i]() { Work(i); }));
+    }
+
+    ThreadPool(const ThreadPool& that) = delete;
+    ThreadPool& operator=(ThreadPool&) = delete;
+
+    ~ThreadPool()
+    {
+        {
+            std::lock_guard<std::mutex> Guard(SleepLock);
+            Stop = true;
+        }
+        Wake.notify_all();
+        for (std::thread& T : Workers)
+            T.join();
+    }
+
+    static ThreadPool& Instance()
+    {
+        static ThreadPool I;
+        return I;
+    }
+
+    unsigned GetThreadCount() const { return Workers.size(); }
+
+    /// Call Body(First, Last) on blocks of [0, Count) of at most 'Grain'
+    /// elements, and return once all of them are done. Ranges are split in
+    /// halves, so idle workers steal large blocks first. The first exception
+    /// thrown by Body is thrown again once every block is done.
+    template <typename BodyType>
+    void ParallelFor(::size_t Count, ::size_t Grain, const BodyType& Body)
+    {
+        if (Count == 0)
+            return;
+        Loop L;
+        L.Remaining = Count;
+        Split(0, Count, std::max< ::size_t>(Grain, 1), Body, L);
+        while (L.Remaining.load() != 0) {
+            if (!RunOne(Self()))
+                std::this_thread::yield();
+        }
+        if (L.Error)
+            std::rethrow_exception(L.Error);
+    }
+
+private:
+    typedef std::function<void()> Task;
+
+    struct TaskQueue
+    {
+        std::mutex Lock;
+        std::deque<Task> Tasks;
+    };
+
+    /// The state of one ParallelFor, shared by its tasks. It lives on the
+    /// caller's stack, so every block counts as done even if it throws.
+    struct Loop
+    {
+        std::atomic< ::size_t> Remaining;
+        std::mutex Lock;
+        std::exception_ptr Error;
+    };
+
+    template <typename BodyType>
+    void Split(::size_t First, ::size_t Last, ::size_t Grain, const BodyType& Body, Loop& L)
+    {
+        try {
+            while (Last - First > Grain) {
+                ::size_t Middle = First + (Last - First) / 2;
+                Push([this, Middle, Last, Grain, &Body, &L]() {
+                    Split(Middle, Last, Grain, Body, L);
+                });
+                Last = Middle;
+            }
+            Body(First, Last);
+        } catch(...) {
+            std::lock_guard<std::mutex> Guard(L.Lock);
+            if (!L.Error)
+                L.Error = std::current_exception();
+        }
+        // The blocks not pushed are done as well
+        L.Remaining -= Last - First;
+    }
+
+    void Push(Task T)
+    {
+        {
+            std::lock_guard<std::mutex> Guard(SleepLock);
+            ++Pending;
+        }
+        TaskQueue& Q = *Queues[Self()];
+        {
+            std::lock_guard<std::mutex> Guard(Q.Lock);
+            Q.Tasks.push_back(std::move(T));
+        }
+        Wake.notify_one();
+    }
+
+    /// Run the newest task of deque 'Index' or the oldest task of another
+    /// deque. Returns false if every deque is empty.
+    bool RunOne(::size_t Index)
+    {
+        Task T;
+        for (::size_t i = 0; i < Queues.size() && !T; ++i) {
+            ::size_t Victim = (Index + i) % Queues.size();
+            TaskQueue& Q = *Queues[Victim];
+            std::lock_guard<std::mutex> Guard(Q.Lock);
+            if (Q.Tasks.empty())
+                continue;
+            if (Victim == Index) {
+                T = std::move(Q.Tasks.back());
+                Q.Tasks.pop_back();
+            } else {
+                T = std::move(Q.Tasks.front());
+                Q.Tasks.pop_front();
+            }
+        }
+        if (!T)
+            return false;
+        --Pending;
+        T();
+        return true;
+    }
+
+    void Work(::size_t Index)
+    {
+        Worker() = std::make_pair(this, Index);
+        for (;;) {
+            if (RunOne(Index))
+                continue;
+            std::unique_lock<std::mutex> Guard(SleepLock);
+            Wake.wait(Guard, [this]() { return Stop || Pending.load() > 0; });
+            if (Stop)
+                return;
+        }
+    }
+
+    /// The deque of the calling thread: its own for a worker, the last one
+    /// for every other thread
+    ::size_t Self() const
+    {
+        return Worker().first == this ? Worker().second : Queues.size() - 1;
+    }
+
+    /// The pool and the index of the worker running on this thread
+    static std::pair<const ThreadPool*, ::size_t>& Worker()
+    {
+        static thread_local std::pair<const ThreadPool*, ::size_t> W {nullptr, 0};
+        return W;
+    }
+
+    std::vector<std::unique_ptr<TaskQueue>> Queues;
+    std::vector<std::thread> Workers;
+    std::mutex SleepLock;
+    std::condition_variable Wake;
+    std::atomic< ::size_t> Pending;
+    bool Stop;
+};
+
+
+} // namespace compute
+
+#endif
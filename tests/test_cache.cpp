@@ -0,0 +1,164 @@
+#define CATCH_CONFIG_MAIN  // This tells Catch to provide a main()
+#include "../tests/catch.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iterator>
+#include <map>
+#include <string>
+#include <vector>
+
+#include <limits.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <utime.h>
+
+#include "../sources/compiler/CompilerCache.h"
+
+
+/// A cache in a new temporary directory, limited to 'MaxSize'. Outputs are
+/// written to the directory, next to the cache.
+static std::string MakeCacheDir(const char* MaxSize)
+{
+    char Dir[] = "/tmp/test_cache.XXXXXX";
+    REQUIRE( mkdtemp(Dir) != nullptr );
+    setenv("CPP_OPENCL_COMPILER_CACHE", (std::string(Dir) + "/cache").c_str(), 1);
+    setenv("CPP_OPENCL_COMPILER_CACHE_SIZE", MaxSize, 1);
+    return Dir;
+}
+
+static void RemoveCacheDir(const std::string& Dir)
+{
+    std::system(("rm -rf " + Dir).c_str());
+}
+
+static void WriteFile(const std::string& FileName, const std::string& Contents)
+{
+    std::ofstream File {FileName};
+    File << Contents;
+}
+
+static std::string ReadFile(const std::string& FileName)
+{
+    std::ifstream File {FileName};
+    return std::string(std::istreambuf_iterator<char>(File), std::istreambuf_iterator<char>());
+}
+
+/// Make the entry of the cache's key look last used at 'Time'
+static void SetLastUse(const compiler::CompilerCache& Cache, time_t Time)
+{
+    utimbuf Times {Time, Time};
+    utime(Cache.GetEntryDir().c_str(), &Times);
+}
+
+
+/// The size parsed from 'Size', or 1 if it is rejected
+static unsigned long long ParsedSize(const char* Size)
+{
+    unsigned long long Bytes = 1;
+    compiler::CompilerCache::ParseSize(Size, Bytes);
+    return Bytes;
+}
+
+
+TEST_CASE( "compiler cache sizes", "[cache]" ) {
+    REQUIRE( ParsedSize("1234") == 1234ULL );
+    REQUIRE( ParsedSize("64K") == 64ULL << 10 );
+    REQUIRE( ParsedSize("500M") == 500ULL << 20 );
+    REQUIRE( ParsedSize("2g") == 2ULL << 30 );
+
+    // Anything else is rejected rather than read as 0
+    REQUIRE( ParsedSize("") == 1ULL );
+    REQUIRE( ParsedSize("big") == 1ULL );
+    REQUIRE( ParsedSize("-5M") == 1ULL );
+    REQUIRE( ParsedSize("5MB") == 1ULL );
+    REQUIRE( ParsedSize("5T") == 1ULL );
+    REQUIRE( ParsedSize("99999999999999999999") == 1ULL );
+    REQUIRE( ParsedSize("99999999999G") == 1ULL );
+}
+
+TEST_CASE( "compiler cache keeps its default size for an invalid one", "[cache]" ) {
+    std::string Dir = MakeCacheDir("lots");
+    compiler::CompilerCache Cache;
+    const std::vector<std::string> Args {"cpp_opencl", "-c", "main.cpp", "-o", "main.o"};
+    std::map<std::string, std::string> Files {{"object", Dir + "/main.o"}};
+
+    // With a limit of 0, storing would evict the entry at once
+    Cache.SetKey("int main() {}", Args);
+    WriteFile(Files["object"], "object code");
+    Cache.Store(Files);
+    REQUIRE( Cache.Restore(Files) );
+
+    RemoveCacheDir(Dir);
+}
+
+TEST_CASE( "compiler cache restores what it stored", "[cache]" ) {
+    std::string Dir = MakeCacheDir("1G");
+    const std::vector<std::string> Args {"cpp_opencl", "-c", "main.cpp", "-o", "main.o"};
+    std::map<std::string, std::string> Files {{"object", Dir + "/main.o"}, {"cl", Dir + "/main.cpp.cl"}};
+
+    compiler::CompilerCache Cache;
+    REQUIRE( Cache.IsEnabled() );
+    Cache.SetKey("int main() {}", Args);
+    REQUIRE( !Cache.Restore(Files) );
+
+    WriteFile(Files["object"], "object code");
+    WriteFile(Files["cl"], "kernel source");
+    Cache.Store(Files);
+    std::remove(Files["object"].c_str());
+    std::remove(Files["cl"].c_str());
+
+    REQUIRE( Cache.Restore(Files) );
+    REQUIRE( ReadFile(Files["object"]) == "object code" );
+    REQUIRE( ReadFile(Files["cl"]) == "kernel source" );
+
+    // The output file is not part of the key, the source is
+    compiler::CompilerCache Other;
+    Other.SetKey("int main() {}", {"cpp_opencl", "-c", "main.cpp", "-o", "other.o"});
+    REQUIRE( Other.GetEntryDir() == Cache.GetEntryDir() );
+    Other.SetKey("int main() { return 1; }", Args);
+    REQUIRE( Other.GetEntryDir() != Cache.GetEntryDir() );
+    REQUIRE( !Other.Restore(Files) );
+
+    // Nor is the same compile in another directory
+    char WorkingDir[PATH_MAX];
+    REQUIRE( getcwd(WorkingDir, sizeof(WorkingDir)) != nullptr );
+    REQUIRE( chdir(Dir.c_str()) == 0 );
+    Other.SetKey("int main() {}", Args);
+    REQUIRE( chdir(WorkingDir) == 0 );
+    REQUIRE( Other.GetEntryDir() != Cache.GetEntryDir() );
+
+    RemoveCacheDir(Dir);
+}
+
+TEST_CASE( "compiler cache evicts the least recently used entries", "[cache]" ) {
+    // Room for two entries of 1000 bytes
+    std::string Dir = MakeCacheDir("2500");
+    const std::vector<std::string> Args {"cpp_opencl", "-c", "main.cpp", "-o", "main.o"};
+    std::map<std::string, std::string> Files {{"object", Dir + "/main.o"}};
+
+    compiler::CompilerCache A, B, C;
+    A.SetKey("a", Args);
+    WriteFile(Files["object"], std::string(1000, 'a'));
+    A.Store(Files);
+    SetLastUse(A, 1000);
+
+    B.SetKey("b", Args);
+    WriteFile(Files["object"], std::string(1000, 'b'));
+    B.Store(Files);
+    SetLastUse(B, 2000);
+
+    // Restoring A makes B the least recently used
+    REQUIRE( A.Restore(Files) );
+    C.SetKey("c", Args);
+    WriteFile(Files["object"], std::string(1000, 'c'));
+    C.Store(Files);
+
+    REQUIRE( !B.Restore(Files) );
+    REQUIRE( A.Restore(Files) );
+    REQUIRE( ReadFile(Files["object"]) == std::string(1000, 'a') );
+    REQUIRE( C.Restore(Files) );
+
+    RemoveCacheDir(Dir);
+}
@@ -0,0 +1,912 @@
+#define CATCH_CONFIG_MAIN  // This tells Catch to provide a main()
+#include "../tests/catch.h"
+
+#include <vector>
+#include <fstream>
+#include <string>
+#include <cstdlib>
+#include <numeric>
+#include <cstdio>
+#include <thread>
+#include <algorithm>
+#include <sstream>
+#include <stdexcept>
+
+#include "../sources/compute/ParallelForEach.h"
+#include "../sources/compute/TaskGraph.h"
+
+
+// OpenCL source as the C backend would generate it for the lambdas below
+static const char KernelFileName[] = "test_compute.cl";
+static const char KernelSource[] = R"(
+__kernel void _Kernel_square(global int* in, global int* out) {
+    unsigned idx = get_global_id(0);
+    out[idx] = in[idx] * in[idx];
+}
+
+__kernel void _Kernel_square_inplace(global int* inout) {
+    unsigned idx = get_global_id(0);
+    inout[idx] = inout[idx] * inout[idx];
+}
+
+__kernel void _Kernel_negate(global int* in, global int* out) {
+    unsigned idx = get_global_id(0);
+    out[idx] = -in[idx];
+}
+
+__kernel void _Kernel_round(global float* in, global char* out) {
+    unsigned idx = get_global_id(0);
+    out[idx] = (char)(in[idx] + 0.5f);
+}
+
+__kernel void _Kernel_scale_lookup(global int* in, global float* out, float scale, global float* table) {
+    unsigned idx = get_global_id(0);
+    out[idx] = table[in[idx]] * scale;
+}
+
+__kernel void _Kernel_sum(global int* in, global int* out, local int* scratch, unsigned n) {
+    unsigned lid = get_local_id(0);
+    unsigned size = get_local_size(0);
+    unsigned group = get_group_id(0);
+    unsigned first = group * size;
+    unsigned count = n - first < size ? n - first : size;
+    if (lid < count) scratch[lid] = in[first + lid];
+    barrier(CLK_LOCAL_MEM_FENCE);
+    for (unsigned s = size / 2; s > 0; s >>= 1) {
+        if (lid < s && lid + s < count) scratch[lid] = scratch[lid] + scratch[lid + s];
+        barrier(CLK_LOCAL_MEM_FENCE);
+    }
+    if (lid == 0) out[group] = scratch[0];
+}
+
+__kernel void _Kernel_prefix_sum(global int* data, global int* sums, local int* scratch, unsigned n) {
+    unsigned lid = get_local_id(0);
+    unsigned size = get_local_size(0);
+    unsigned group = get_group_id(0);
+    unsigned block = 2 * size;
+    unsigned first = group * block;
+    unsigned count = n - first < block ? n - first : block;
+    if (lid < count) scratch[lid] = data[first + lid];
+    if (lid + size < count) scratch[lid + size] = data[first + lid + size];
+    for (unsigned stride = 1; stride < block; stride *= 2) {
+        barrier(CLK_LOCAL_MEM_FENCE);
+        unsigned i = (lid + 1) * stride * 2 - 1;
+        if (i < count) scratch[i] = scratch[i - stride] + scratch[i];
+    }
+    for (unsigned stride = block / 4; stride > 0; stride /= 2) {
+        barrier(CLK_LOCAL_MEM_FENCE);
+        unsigned i = (lid + 1) * stride * 2 - 1;
+        if (i + stride < count) scratch[i + stride] = scratch[i] + scratch[i + stride];
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+    if (lid < count) data[first + lid] = scratch[lid];
+    if (lid + size < count) data[first + lid + size] = scratch[lid + size];
+    if (lid == 0) sums[group] = scratch[count - 1];
+}
+
+__kernel void _Kernel_prefix_sum_propagate(global int* data, global int* sums, unsigned n) {
+    unsigned lid = get_local_id(0);
+    unsigned size = get_local_size(0);
+    unsigned group = get_group_id(0);
+    unsigned first = group * 2 * size;
+    if (group == 0) return;
+    if (first + lid < n) data[first + lid] = sums[group - 1] + data[first + lid];
+    if (first + lid + size < n) data[first + lid + size] = sums[group - 1] + data[first + lid + size];
+}
+
+__kernel void _Kernel_square_negate(global int* in, global int* out) {
+    unsigned idx = get_global_id(0);
+    out[idx] = -(in[idx] * in[idx]);
+}
+
+__kernel void _Kernel_point_sum(global int2* in, global int* out) {
+    unsigned idx = get_global_id(0);
+    out[idx] = in[idx].x + in[idx].y;
+}
+
+__kernel void _Kernel_index2d(global int* out) {
+    unsigned row = get_global_id(1);
+    unsigned col = get_global_id(0);
+    out[row * get_global_size(0) + col] = row * 100 + col;
+}
+
+__kernel void _Kernel_multiply_add(global int* in0, global float* in1, global int* in2, global float* out) {
+    unsigned idx = get_global_id(0);
+    out[idx] = in0[idx] * in1[idx] + in2[idx];
+}
+)";
+
+static void WriteKernelFile()
+{
+    std::ofstream Afile {KernelFileName};
+    Afile << KernelSource;
+}
+
+/// Every test starts with the kernel file written and no kernel cached
+static compute::Accelerator& Setup()
+{
+    WriteKernelFile();
+    compute::Accelerator& K = compute::Accelerator::Instance();
+    K.ClearKernelCache();
+    return K;
+}
+
+
+TEST_CASE( "cached kernels", "[compute]" ) {
+
+    compute::Accelerator& K = Setup();
+
+    SECTION( "parallel_for_each reuses built kernels" ) {
+        std::vector<int> In {1,2,3,4,5,6};
+        std::vector<int> Out(6);
+
+        for (int i = 0; i < 3; ++i) {
+            compute::parallel_for_each(In.begin(), In.end(), Out.begin(), [](int x) {
+                return std::pair<std::string,std::string> ( KernelFileName, "_Kernel_square" );
+            });
+            REQUIRE( 1 == Out[0] );
+            REQUIRE( 36 == Out[5] );
+        }
+
+        compute::KernelCacheStats Stats = K.GetKernelCacheStats();
+        REQUIRE( 1 == Stats.Misses );
+        REQUIRE( 2 == Stats.Hits );
+
+        compute::parallel_for_each(In.begin(), In.end(), Out.begin(), [](int x) {
+            return std::pair<std::string,std::string> ( KernelFileName, "_Kernel_negate" );
+        });
+        REQUIRE( -1 == Out[0] );
+        REQUIRE( 2 == K.GetKernelCacheStats().Misses );
+    }
+
+    SECTION( "kernels built with different options are cached separately" ) {
+        std::vector<int> In {1,2,3};
+        std::vector<int> Out(3);
+
+        K.LoadKernel(KernelFileName, "_Kernel_square");
+        K.SetBuildOptions("-cl-fast-relaxed-math");
+        K.LoadKernel(KernelFileName, "_Kernel_square");
+        K.Run(In.begin(), In.end(), Out.begin());
+        K.SetBuildOptions("");
+
+        REQUIRE( 9 == Out[2] );
+        REQUIRE( 2 == K.GetKernelCacheStats().Misses );
+        REQUIRE( 0 == K.GetKernelCacheStats().Hits );
+    }
+}
+
+
+TEST_CASE( "binary cache", "[compute]" ) {
+
+    compute::Accelerator& K = Setup();
+
+    SECTION( "programs are loaded from the binary cache" ) {
+        std::vector<int> In {1,2,3};
+        std::vector<int> Out(3);
+
+        std::system("rm -rf test_compute_cache");
+        K.SetBinaryCacheDirectory("test_compute_cache");
+        K.LoadKernel(KernelFileName, "_Kernel_square");
+        REQUIRE( 1 == K.GetKernelCacheStats().BinaryMisses );
+
+        // A fresh process has nothing in memory
+        K.ClearKernelCache();
+        K.LoadKernel(KernelFileName, "_Kernel_square");
+        K.Run(In.begin(), In.end(), Out.begin());
+        K.SetBinaryCacheDirectory("");
+
+        REQUIRE( 1 == K.GetKernelCacheStats().BinaryHits );
+        REQUIRE( 0 == K.GetKernelCacheStats().BinaryMisses );
+        REQUIRE( 9 == Out[2] );
+    }
+}
+
+
+TEST_CASE( "buffer pool", "[compute]" ) {
+
+    compute::Accelerator& K = Setup();
+
+    SECTION( "device buffers are reused across launches" ) {
+        std::vector<int> In {1,2,3,4,5,6};
+        std::vector<int> Out(6);
+        compute::BufferPool& Pool = K.GetBufferPool();
+        Pool.Trim();
+        compute::BufferPoolStats Before = Pool.GetStats();
+
+        K.LoadKernel(KernelFileName, "_Kernel_square");
+        K.Run(In.begin(), In.end(), Out.begin());
+        K.Run(In.begin(), In.end(), Out.begin());
+
+        compute::BufferPoolStats After = Pool.GetStats();
+        REQUIRE( 2 == After.Misses - Before.Misses );
+        REQUIRE( 2 == After.Hits - Before.Hits );
+        ::size_t Held = 2 * compute::BufferPool::GetBucketSize(6 * sizeof(int));
+        REQUIRE( Held == After.BytesHeld );
+
+        Pool.Trim();
+        REQUIRE( 0 == Pool.GetStats().BytesHeld );
+    }
+}
+
+
+TEST_CASE( "asynchronous launches", "[compute]" ) {
+
+    compute::Accelerator& K = Setup();
+
+    SECTION( "asynchronous launches are chained through the queue" ) {
+        std::vector<int> In {1,2,3,4,5,6};
+        std::vector<int> Tmp(6);
+        std::vector<int> Out(6);
+
+        compute::completion_future Square =
+            compute::parallel_for_each_async(In.begin(), In.end(), Tmp.begin(), [](int x) {
+                return std::pair<std::string,std::string> ( KernelFileName, "_Kernel_square" );
+            });
+        compute::completion_future Negate =
+            compute::parallel_for_each_async(Tmp.begin(), Tmp.end(), Out.begin(), [](int x) {
+                return std::pair<std::string,std::string> ( KernelFileName, "_Kernel_negate" );
+            });
+
+        Negate.wait();
+        REQUIRE( Square.is_ready() );
+        REQUIRE( Negate.is_ready() );
+        REQUIRE( -1 == Out[0] );
+        REQUIRE( -36 == Out[5] );
+    }
+
+    SECTION( "a failed launch is ready and its wait throws" ) {
+        cl::UserEvent Failed(K.GetContext());
+        compute::completion_future Future(Failed, {});
+        REQUIRE( !Future.is_ready() );
+        Failed.setStatus(CL_INVALID_VALUE);
+        REQUIRE( Future.is_ready() );
+        REQUIRE_THROWS_AS( Future.wait(), cl::Error& );
+        REQUIRE( Future.is_ready() );
+    }
+}
+
+
+TEST_CASE( "streamed launches", "[compute]" ) {
+
+    compute::Accelerator& K = Setup();
+
+    SECTION( "large ranges are streamed through the device in chunks" ) {
+        std::vector<int> In(1000);
+        std::vector<int> Out(1000);
+        for (int i = 0; i < 1000; ++i) In[i] = i;
+
+        K.SetChunkSize(64);
+        compute::parallel_for_each(In.begin(), In.end(), Out.begin(), [](int x) {
+            return std::pair<std::string,std::string> ( KernelFileName, "_Kernel_square" );
+        });
+        K.SetChunkSize(0);
+
+        for (int i = 0; i < 1000; ++i)
+            REQUIRE( Out[i] == i * i );
+    }
+}
+
+
+TEST_CASE( "zero-copy launches", "[compute]" ) {
+
+    compute::Accelerator& K = Setup();
+
+    SECTION( "aligned host memory is used in place" ) {
+        alignas(4096) static int In[1024];
+        alignas(4096) static int Out[1024];
+        for (int i = 0; i < 1024; ++i) In[i] = i;
+
+        K.LoadKernel(KernelFileName, "_Kernel_negate");
+        compute::LaunchStats Before = K.GetLaunchStats();
+        K.Run(In, In + 1024, Out);
+        compute::LaunchStats After = K.GetLaunchStats();
+        REQUIRE( 0 == Out[0] );
+        REQUIRE( -1023 == Out[1023] );
+        if (K.GetDevice().getInfo<CL_DEVICE_HOST_UNIFIED_MEMORY>())
+            REQUIRE( After.ZeroCopy == Before.ZeroCopy + 1 );
+        else
+            REQUIRE( After.Copied == Before.Copied + 1 );
+
+        // Unaligned ranges fall back to copying
+        std::fill(Out, Out + 1024, 0);
+        Before = K.GetLaunchStats();
+        K.Run(In + 1, In + 1024, Out + 1);
+        After = K.GetLaunchStats();
+        REQUIRE( 0 == Out[0] );
+        REQUIRE( -1 == Out[1] );
+        REQUIRE( -1023 == Out[1023] );
+        REQUIRE( After.Copied == Before.Copied + 1 );
+        REQUIRE( Before.ZeroCopy == After.ZeroCopy );
+    }
+}
+
+
+TEST_CASE( "in-place launches", "[compute]" ) {
+
+    compute::Accelerator& K = Setup();
+
+    SECTION( "in-place launches use the in-place kernel variant" ) {
+        std::vector<int> InOut {1,2,3,4,5,6};
+
+        compute::parallel_for_each(InOut.begin(), InOut.end(), InOut.begin(), [](int x) {
+            return std::pair<std::string,std::string> ( KernelFileName, "_Kernel_square" );
+        });
+        REQUIRE( 4 == InOut[1] );
+        REQUIRE( 36 == InOut[5] );
+        REQUIRE( K.HasKernel(KernelFileName, "_Kernel_square_inplace") );
+
+        // Without an in-place variant the regular kernel is used
+        compute::parallel_for_each(InOut.begin(), InOut.end(), InOut.begin(), [](int x) {
+            return std::pair<std::string,std::string> ( KernelFileName, "_Kernel_negate" );
+        });
+        REQUIRE( -4 == InOut[1] );
+    }
+
+    SECTION( "aliased host memory is copied without an in-place kernel" ) {
+        alignas(4096) static int InOut[1024];
+        for (int i = 0; i < 1024; ++i) InOut[i] = i;
+
+        compute::LaunchStats Before = K.GetLaunchStats();
+        compute::parallel_for_each(InOut, InOut + 1024, InOut, [](int x) {
+            return std::pair<std::string,std::string> ( KernelFileName, "_Kernel_negate" );
+        });
+        compute::LaunchStats After = K.GetLaunchStats();
+        for (int i = 0; i < 1024; ++i)
+            REQUIRE( InOut[i] == -i );
+        REQUIRE( After.Copied == Before.Copied + 1 );
+        REQUIRE( Before.ZeroCopy == After.ZeroCopy );
+    }
+}
+
+
+TEST_CASE( "several input ranges", "[compute]" ) {
+
+    Setup();
+
+    SECTION( "several input ranges are passed as separate buffers" ) {
+        std::vector<int> A {1,2,3,4};
+        std::vector<float> B {0.5f,1.5f,2.5f,3.5f};
+        std::vector<int> C {10,20,30,40};
+        std::vector<float> Out(4);
+
+        compute::parallel_for_each(A.begin(), A.end(), B.begin(), C.begin(), Out.begin(), [](int a, float b, int c) {
+            return std::pair<std::string,std::string> ( KernelFileName, "_Kernel_multiply_add" );
+        });
+        REQUIRE( 10.5f == Out[0] );
+        REQUIRE( 54.0f == Out[3] );
+    }
+}
+
+
+TEST_CASE( "element types", "[compute]" ) {
+
+    Setup();
+
+    SECTION( "the output is sized by its own element type" ) {
+        std::vector<float> In {0.2f,1.7f,2.4f,126.6f};
+        std::vector<char> Out(5, 'x');
+
+        compute::parallel_for_each(In.begin(), In.end(), Out.begin(), [](float x) {
+            return std::pair<std::string,std::string> ( KernelFileName, "_Kernel_round" );
+        });
+        REQUIRE( 0 == Out[0] );
+        REQUIRE( 2 == Out[1] );
+        REQUIRE( 127 == Out[3] );
+        // Nothing is written past the end of the output range
+        REQUIRE( 'x' == Out[4] );
+    }
+
+    SECTION( "inputs may be of any element type" ) {
+        struct Point { int x, y; };
+        std::vector<Point> In {{1,2}, {3,4}, {5,6}};
+        std::vector<int> Out(3);
+
+        compute::parallel_for_each(In.begin(), In.end(), Out.begin(), [](const Point& p) {
+            return std::pair<std::string,std::string> ( KernelFileName, "_Kernel_point_sum" );
+        });
+        REQUIRE( 3 == Out[0] );
+        REQUIRE( 7 == Out[1] );
+        REQUIRE( 11 == Out[2] );
+    }
+}
+
+
+TEST_CASE( "lambda captures", "[compute]" ) {
+
+    Setup();
+
+    SECTION( "lambda captures are passed as kernel arguments" ) {
+        std::vector<int> In {0,1,2,1};
+        std::vector<float> Out(4);
+        std::vector<float> Table {1.0f, 2.0f, 4.0f};
+        float Scale = 0.5f;
+
+        auto Kernel = [Scale, &Table](int x) {
+            return std::make_tuple(std::string(KernelFileName), std::string("_Kernel_scale_lookup"),
+                                   compute::detail::Capture(Scale), compute::detail::Capture(Table));
+        };
+        compute::parallel_for_each(In.begin(), In.end(), Out.begin(), Kernel);
+        REQUIRE( 0.5f == Out[0] );
+        REQUIRE( 2.0f == Out[2] );
+
+        // A changed table is uploaded again
+        Table[1] = 8.0f;
+        compute::parallel_for_each(In.begin(), In.end(), Out.begin(), Kernel);
+        REQUIRE( 4.0f == Out[1] );
+        REQUIRE( 4.0f == Out[3] );
+    }
+}
+
+
+TEST_CASE( "reduce", "[compute]" ) {
+
+    Setup();
+
+    SECTION( "reduce combines the partial results on the device" ) {
+        std::vector<int> In(100000);
+        for (int i = 0; i < 100000; ++i) In[i] = i % 7;
+        int Expected = std::accumulate(In.begin(), In.end(), 5);
+
+        int Sum = compute::reduce(In.begin(), In.end(), 5, [](int a, int b) {
+            return std::pair<std::string,std::string> ( KernelFileName, "_Kernel_sum" );
+        });
+        REQUIRE( Expected == Sum );
+
+        std::vector<int> Empty;
+        int Init = compute::reduce(Empty.begin(), Empty.end(), 5, [](int a, int b) {
+            return std::pair<std::string,std::string> ( KernelFileName, "_Kernel_sum" );
+        });
+        REQUIRE( 5 == Init );
+    }
+}
+
+
+TEST_CASE( "scans", "[compute]" ) {
+
+    Setup();
+
+    SECTION( "scans span several work-groups" ) {
+        std::vector<int> In(100000);
+        for (int i = 0; i < 100000; ++i) In[i] = i % 5;
+        std::vector<int> Expected(100000);
+        std::partial_sum(In.begin(), In.end(), Expected.begin());
+
+        std::vector<int> Out(100000);
+        compute::inclusive_scan(In.begin(), In.end(), Out.begin(), [](int a, int b) {
+            return std::pair<std::string,std::string> ( KernelFileName, "_Kernel_prefix_sum" );
+        });
+        REQUIRE( Expected == Out );
+
+        compute::exclusive_scan(In.begin(), In.end(), Out.begin(), 10, [](int a, int b) {
+            return std::pair<std::string,std::string> ( KernelFileName, "_Kernel_prefix_sum" );
+        });
+        REQUIRE( 10 == Out[0] );
+        REQUIRE( Out[99999] == 10 + Expected[99998] );
+    }
+}
+
+
+TEST_CASE( "index spaces", "[compute]" ) {
+
+    compute::Accelerator& K = Setup();
+
+    SECTION( "parallel_for launches a two dimensional index space" ) {
+        std::vector<int> Out(3 * 5);
+
+        compute::parallel_for(compute::extent<2>{3, 5}, Out.begin(), [](compute::index<2> idx) {
+            return std::pair<std::string,std::string> ( KernelFileName, "_Kernel_index2d" );
+        });
+        REQUIRE( 0 == Out[0] );
+        REQUIRE( 4 == Out[4] );
+        REQUIRE( 100 == Out[5] );
+        REQUIRE( 204 == Out[14] );
+    }
+
+    SECTION( "parallel_for launches work-groups that divide the index space" ) {
+        std::vector<int> Out(16 * 64);
+
+        compute::parallel_for(compute::extent<2>{16, 64}, Out.begin(), [](compute::index<2> idx) {
+            return std::pair<std::string,std::string> ( KernelFileName, "_Kernel_index2d" );
+        });
+        REQUIRE( 63 == Out[63] );
+        REQUIRE( 1563 == Out[15 * 64 + 63] );
+
+        cl::NDRange Local = K.GetPreferredLocalRange(cl::NDRange(64, 16));
+        REQUIRE( 2 == Local.dimensions() );
+        REQUIRE( 0 == 64 % Local[0] );
+        REQUIRE( 0 == 16 % Local[1] );
+        REQUIRE( 1 < Local[0] * Local[1] );
+    }
+}
+
+
+TEST_CASE( "work-group size tuning", "[compute]" ) {
+
+    compute::Accelerator& K = Setup();
+
+    SECTION( "tuned work-group sizes are kept between runs" ) {
+        std::vector<int> In(4096);
+        std::vector<int> Out(4096);
+        for (int i = 0; i < 4096; ++i) In[i] = i;
+
+        std::remove("test_compute.tuning");
+        K.SetTuningFile("test_compute.tuning");
+        K.SetAutoTuning(true);
+        for (int i = 0; i < 20; ++i) {
+            compute::parallel_for_each(In.begin(), In.end(), Out.begin(), [](int x) {
+                return std::pair<std::string,std::string> ( KernelFileName, "_Kernel_negate" );
+            });
+            REQUIRE( -4095 == Out[4095] );
+        }
+        ::size_t LocalSize = K.GetTunedLocalSize(KernelFileName, "_Kernel_negate");
+
+        // A fresh process reads the results back
+        K.ClearTuning();
+        K.SetTuningFile("test_compute.tuning");
+        REQUIRE( LocalSize == K.GetTunedLocalSize(KernelFileName, "_Kernel_negate") );
+        std::ifstream TuningFile {"test_compute.tuning"};
+        REQUIRE( TuningFile.good() );
+
+        K.SetAutoTuning(false);
+        K.SetTuningFile("");
+    }
+}
+
+
+TEST_CASE( "several devices", "[compute]" ) {
+
+    compute::Accelerator& K = Setup();
+
+    SECTION( "launches are split across several devices" ) {
+        // Partition the first device into sub-devices, where supported
+        cl::Device Root = K.GetDevices()[0];
+        VECTOR_CLASS<cl::Device> SubDevices;
+        cl_uint Units = Root.getInfo<CL_DEVICE_MAX_COMPUTE_UNITS>();
+        const cl_device_partition_property Properties[] = {
+            CL_DEVICE_PARTITION_EQUALLY, static_cast<cl_device_partition_property>(std::max<cl_uint>(Units / 2, 1)), 0
+        };
+        try {
+            Root.createSubDevices(Properties, &SubDevices);
+        } catch(cl::Error&) {
+            SubDevices.clear();
+        }
+        if (SubDevices.size() < 2) {
+            WARN( "The device cannot be partitioned: launches across several devices are not tested" );
+            return;
+        }
+
+        std::vector<int> In(10000);
+        std::vector<int> Out(10000);
+        for (int i = 0; i < 10000; ++i) In[i] = i;
+
+        K.SelectDevices(SubDevices);
+        REQUIRE( SubDevices.size() == K.GetDevices().size() );
+
+        std::vector<double> Weights(SubDevices.size(), 1);
+        Weights[0] = 3;
+        K.SetDeviceWeights(Weights);
+        compute::parallel_for_each(In.begin(), In.end(), Out.begin(), [](int x) {
+            return std::pair<std::string,std::string> ( KernelFileName, "_Kernel_negate" );
+        });
+        REQUIRE( 0 == Out[0] );
+        REQUIRE( -9999 == Out[9999] );
+
+        // The first device gets three shares, every other device one
+        std::vector< ::size_t> Sizes = K.GetPartitionSizes();
+        REQUIRE( SubDevices.size() == Sizes.size() );
+        ::size_t Expected = static_cast< ::size_t>(3.0 / (SubDevices.size() + 2) * 10000 + 0.5);
+        REQUIRE( Expected == Sizes[0] );
+        REQUIRE( 10000 == std::accumulate(Sizes.begin(), Sizes.end(), ::size_t(0)) );
+
+        // Parts larger than the chunk size are streamed through their device
+        std::fill(Out.begin(), Out.end(), 0);
+        K.SetChunkSize(1000);
+        compute::parallel_for_each(In.begin(), In.end(), Out.begin(), [](int x) {
+            return std::pair<std::string,std::string> ( KernelFileName, "_Kernel_negate" );
+        });
+        K.SetChunkSize(0);
+        REQUIRE( -1 == Out[1] );
+        REQUIRE( -5000 == Out[5000] );
+        REQUIRE( -9999 == Out[9999] );
+
+        // Measured weights change from launch to launch but keep summing to 1
+        K.SetDeviceWeights({});
+        for (int i = 0; i < 5; ++i) {
+            compute::parallel_for_each(In.begin(), In.end(), Out.begin(), [](int x) {
+                return std::pair<std::string,std::string> ( KernelFileName, "_Kernel_square" );
+            });
+            REQUIRE( 99960004 == Out[9998] );
+        }
+        std::vector<double> Measured = K.GetDeviceWeights();
+        double Sum = std::accumulate(Measured.begin(), Measured.end(), 0.0);
+        REQUIRE( Sum == Approx(1) );
+
+        K.SelectDevices({Root});
+    }
+
+    SECTION( "buffers borrowed before a reset are not reused" ) {
+        compute::BufferPool& Pool = K.GetBufferPool();
+        Pool.Trim();
+        compute::PooledBuffer B = Pool.Acquire(64);
+        Pool.Reset(K.GetContext());
+        B = compute::PooledBuffer();
+        REQUIRE( 0 == Pool.GetStats().BytesHeld );
+
+        B = Pool.Acquire(64);
+        B = compute::PooledBuffer();
+        REQUIRE( compute::BufferPool::GetBucketSize(64) == Pool.GetStats().BytesHeld );
+        Pool.Trim();
+    }
+}
+
+
+TEST_CASE( "concurrent launches", "[compute]" ) {
+
+    compute::Accelerator& K = Setup();
+
+    SECTION( "threads launch the same kernels concurrently" ) {
+        const int ThreadCount = 8;
+        std::vector<int> Failures(ThreadCount);
+        std::vector<std::thread> Threads;
+        for (int t = 0; t < ThreadCount; ++t) {
+            Threads.push_back(std::thread([t, &Failures]() {
+                std::vector<int> In(1000);
+                std::vector<int> Out(1000);
+                for (int i = 0; i < 1000; ++i) In[i] = t * 1000 + i;
+
+                // Alternate kernels so that launches of other threads
+                // interleave with changes of the current kernel
+                for (int Round = 0; Round < 50; ++Round) {
+                    compute::parallel_for_each(In.begin(), In.end(), Out.begin(), [](int x) {
+                        return std::pair<std::string,std::string> ( KernelFileName, "_Kernel_negate" );
+                    });
+                    for (int i = 0; i < 1000; ++i)
+                        Failures[t] += Out[i] != -In[i];
+                    compute::parallel_for_each(In.begin(), In.end(), Out.begin(), [](int x) {
+                        return std::pair<std::string,std::string> ( KernelFileName, "_Kernel_square" );
+                    });
+                    for (int i = 0; i < 1000; ++i)
+                        Failures[t] += Out[i] != In[i] * In[i];
+                }
+            }));
+        }
+        for (std::thread& T : Threads)
+            T.join();
+
+        REQUIRE( 0 == std::accumulate(Failures.begin(), Failures.end(), 0) );
+        // Every thread creates its own kernel objects
+        ::size_t Kernels = 2 * ThreadCount;
+        REQUIRE( Kernels == K.GetKernelCacheStats().Misses );
+    }
+}
+
+
+TEST_CASE( "host thread pool", "[compute]" ) {
+
+    compute::Accelerator& K = Setup();
+
+    SECTION( "small ranges run the host copy of the lambda" ) {
+        auto Square = compute::detail::WithHost([](int x) {
+            return std::pair<std::string,std::string> ( KernelFileName, "_Kernel_square" );
+        }, [](int x) {
+            return x * x;
+        });
+
+        std::vector<int> Small {1,2,3,4,5,6};
+        std::vector<int> SmallOut(6);
+        K.SetHostThreshold(100);
+        compute::parallel_for_each(Small.begin(), Small.end(), SmallOut.begin(), Square);
+        REQUIRE( 36 == SmallOut[5] );
+        REQUIRE( 0 == K.GetKernelCacheStats().Misses );
+
+        std::vector<int> Large(1000, 3);
+        std::vector<int> LargeOut(1000);
+        compute::parallel_for_each(Large.begin(), Large.end(), LargeOut.begin(), Square);
+        REQUIRE( 9 == LargeOut[999] );
+        REQUIRE( 1 == K.GetKernelCacheStats().Misses );
+
+        // Once the kernel has run on the host its threshold is calibrated
+        K.SetHostThreshold(0);
+        compute::parallel_for_each(Small.begin(), Small.end(), SmallOut.begin(), Square);
+        REQUIRE( K.GetHostThreshold(KernelFileName, "_Kernel_square") != K.GetHostThreshold(KernelFileName, "_Kernel_never_run") );
+
+        // The calibrated threshold is the launch overhead over the host time per element
+        K.AddHostTime(KernelFileName, "_Kernel_calibrated", 1000, 0.001);
+        ::size_t Expected = static_cast< ::size_t>(K.GetLaunchOverhead() / (0.001 / 1000));
+        REQUIRE( K.GetHostThreshold(KernelFileName, "_Kernel_calibrated") == Expected );
+    }
+
+    SECTION( "the host thread pool covers every element once" ) {
+        std::vector<int> Counts(100000);
+        compute::ThreadPool::Instance().ParallelFor(Counts.size(), 64, [&Counts](::size_t First, ::size_t Last) {
+            for (::size_t i = First; i < Last; ++i)
+                ++Counts[i];
+        });
+        REQUIRE( 100000 == std::count(Counts.begin(), Counts.end(), 1) );
+    }
+
+    SECTION( "a thread pool loop throws the body's exception after every block is done" ) {
+        std::vector<int> Counts(100000, 0);
+        REQUIRE_THROWS_AS( compute::ThreadPool::Instance().ParallelFor(Counts.size(), 64, [&Counts](::size_t First, ::size_t Last) {
+            for (::size_t i = First; i < Last; ++i)
+                ++Counts[i];
+            if (First == 0)
+                throw std::runtime_error("first block");
+        }), std::runtime_error& );
+        REQUIRE( 100000 == std::count(Counts.begin(), Counts.end(), 1) );
+    }
+}
+
+
+TEST_CASE( "task graphs", "[compute]" ) {
+
+    Setup();
+
+    SECTION( "task graphs run tasks after their dependencies" ) {
+        std::vector<int> A {1,2,3,4};
+        std::vector<int> B {5,6,7,8};
+        std::vector<int> Squares(4);
+        std::vector<int> Negated(4);
+        std::vector<int> Sums(4);
+        const ::size_t Bytes = 4 * sizeof(int);
+
+        compute::TaskGraph G;
+        cl::Buffer InA = G.CreateBuffer(Bytes);
+        cl::Buffer InB = G.CreateBuffer(Bytes);
+        cl::Buffer OutA = G.CreateBuffer(Bytes);
+        cl::Buffer OutB = G.CreateBuffer(Bytes);
+
+        // Two independent chains, joined by a host task
+        auto WriteA = G.Write(InA, A.begin(), A.end());
+        auto WriteB = G.Write(InB, B.begin(), B.end());
+        auto Square = G.Launch(KernelFileName, "_Kernel_square", cl::NDRange(4), {WriteA}, InA, OutA);
+        auto Negate = G.Launch(KernelFileName, "_Kernel_negate", cl::NDRange(4), {WriteB}, InB, OutB);
+        auto ReadA = G.Read(OutA, Squares.begin(), Squares.end(), {Square});
+        auto ReadB = G.Read(OutB, Negated.begin(), Negated.end(), {Negate});
+        auto Add = G.Host([&]() {
+            for (int i = 0; i < 4; ++i)
+                Sums[i] = Squares[i] + Negated[i];
+        }, {ReadA, ReadB});
+        auto WriteSums = G.Write(InA, Sums.begin(), Sums.end(), {Add});
+        auto SquareSums = G.Launch(KernelFileName, "_Kernel_square", cl::NDRange(4), {WriteSums}, InA, OutA);
+        G.Read(OutA, Squares.begin(), Squares.end(), {SquareSums});
+        G.Wait();
+
+        REQUIRE( -8 == Negated[3] );
+        REQUIRE( 8 == Sums[3] );
+        REQUIRE( 16 == Squares[0] );
+        REQUIRE( 64 == Squares[3] );
+    }
+
+    SECTION( "a task graph throws the exception of a failed host callback" ) {
+        std::vector<int> In {1,2,3,4};
+        std::vector<int> Out(4);
+        const ::size_t Bytes = 4 * sizeof(int);
+
+        compute::TaskGraph G;
+        cl::Buffer Buffer = G.CreateBuffer(Bytes);
+        auto Write = G.Write(Buffer, In.begin(), In.end());
+        auto Fail = G.Host([]() { throw std::runtime_error("host task failed"); }, {Write});
+        G.Read(Buffer, Out.begin(), Out.end(), {Fail});
+        REQUIRE_THROWS_AS( G.Wait(), std::runtime_error& );
+
+        // The failure is reported once, and the graph can still be used
+        G.Read(Buffer, Out.begin(), Out.end(), {Write});
+        G.Wait();
+        REQUIRE( 4 == Out[3] );
+    }
+}
+
+
+TEST_CASE( "profiling", "[compute]" ) {
+
+    compute::Accelerator& K = Setup();
+
+    SECTION( "profiling records transfers and kernels" ) {
+        // Copy the ranges, so that the uploads are recorded as well
+        K.SetZeroCopy(false);
+        K.SetProfiling(true);
+        K.ClearProfile();
+        std::vector<int> In(1000, 3);
+        std::vector<int> Out(1000);
+        compute::parallel_for_each(In.begin(), In.end(), Out.begin(), [](int x) {
+            return std::pair<std::string,std::string> ( KernelFileName, "_Kernel_square" );
+        });
+        REQUIRE( 9 == Out[999] );
+
+        std::vector<compute::ProfileStats> Stats = K.GetProfileStats();
+        auto Kernel = std::find_if(Stats.begin(), Stats.end(), [](const compute::ProfileStats& S) {
+            return S.Kind == "kernel";
+        });
+        REQUIRE( Kernel != Stats.end() );
+        REQUIRE( 1 == Kernel->Count );
+        REQUIRE( Kernel->P50 <= Kernel->P99 );
+        auto Write = std::find_if(Stats.begin(), Stats.end(), [](const compute::ProfileStats& S) {
+            return S.Kind == "write";
+        });
+        REQUIRE( Write != Stats.end() );
+        REQUIRE( 4000 == Write->Bytes );
+
+        std::ostringstream Trace;
+        K.WriteProfile(Trace);
+        REQUIRE( std::string::npos != Trace.str().find("\"traceEvents\"") );
+        K.SetProfiling(false);
+        K.ClearProfile();
+        K.SetZeroCopy(true);
+    }
+}
+
+
+TEST_CASE( "kernel fusion", "[compute]" ) {
+
+    compute::Accelerator& K = Setup();
+
+    SECTION( "pipelines run their stages as one kernel" ) {
+        std::vector<int> In {1,2,3,4,5,6};
+        std::vector<int> Out(6);
+        compute::pipeline(In.begin(), In.end())
+            | compute::map([](int x) {
+                return std::pair<std::string,std::string> ( KernelFileName, "_Kernel_square" );
+            })
+            | compute::map([](int x) {
+                return std::pair<std::string,std::string> ( KernelFileName, "_Kernel_negate" );
+            })
+            | compute::into(Out.begin());
+        REQUIRE( -1 == Out[0] );
+        REQUIRE( -36 == Out[5] );
+        REQUIRE( 1 == K.GetKernelCacheStats().Misses );
+        REQUIRE( K.HasKernel(KernelFileName, "_Kernel_square_negate") );
+    }
+
+    SECTION( "pipeline stages may take elements of any type" ) {
+        struct Point { int x, y; };
+        auto Length = [](const Point& p) {
+            return std::pair<std::string,std::string> ( KernelFileName, "_Kernel_length" );
+        };
+        auto Half = [](float x) {
+            return std::pair<std::string,std::string> ( KernelFileName, "_Kernel_half" );
+        };
+        auto Fused = compute::detail::MakeFusedKernel(std::make_tuple(Length, Half), std::false_type());
+        auto Result = Fused(0);
+        REQUIRE( std::get<1>(Result) == "_Kernel_length_half" );
+    }
+
+    SECTION( "pipelines of host copies run on the host" ) {
+        auto Square = compute::detail::WithHost([](int x) {
+            return std::pair<std::string,std::string> ( KernelFileName, "_Kernel_square" );
+        }, [](int x) {
+            return x * x;
+        });
+        auto Negate = compute::detail::WithHost([](int x) {
+            return std::pair<std::string,std::string> ( KernelFileName, "_Kernel_negate" );
+        }, [](int x) {
+            return -x;
+        });
+
+        std::vector<int> In {1,2,3,4,5,6};
+        std::vector<int> Out(6);
+        K.SetHostThreshold(100);
+        compute::pipeline(In.begin(), In.end()) | compute::map(Square) | compute::map(Negate) | compute::into(Out.begin());
+        K.SetHostThreshold(0);
+        REQUIRE( -36 == Out[5] );
+        REQUIRE( 0 == K.GetKernelCacheStats().Misses );
+    }
+}
+
+
+TEST_CASE( "embedded sources", "[compute]" ) {
+
+    Setup();
+
+    SECTION( "embedded OpenCL sources are used in place of their file" ) {
+        static compute::detail::EmbeddedSource Embedded {"embedded_test_compute.cl", KernelSource};
+        std::vector<int> In {1,2,3};
+        std::vector<int> Out(3);
+
+        compute::parallel_for_each(In.begin(), In.end(), Out.begin(), [](int x) {
+            return std::pair<std::string,std::string> ( "embedded_test_compute.cl", "_Kernel_square" );
+        });
+        REQUIRE( 1 == Out[0] );
+        REQUIRE( 9 == Out[2] );
+    }
+}
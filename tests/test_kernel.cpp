@@ -154,7 +154,12 @@ private:
             "-I/usr/include",
             "-c", FileName
         };
-        KernelCode = compiler::MainEntry(17, CmdLine, compiler::BuildClCode)[0];
+        if (compiler::MainEntry(17, CmdLine, compiler::BuildClCode) != 0)
+            throw std::runtime_error("Failed to compile kernel.cpp");
+        std::ifstream ClFile(std::string(FileName) + ".cl");
+        KernelCode.assign(
+            std::istreambuf_iterator<char>(ClFile),
+            (std::istreambuf_iterator<char>()));
 
 #ifdef HACK
         std::ifstream sourceFile("/tmp/opencl_temp.cl");
@@ -0,0 +1,49 @@
+#define CATCH_CONFIG_MAIN  // This tells Catch to provide a main()
+#include "../tests/catch.h"
+
+#include <string>
+#include <vector>
+
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "../sources/compiler/CompileProtocol.h"
+
+
+TEST_CASE( "compile server protocol", "[protocol]" ) {
+
+    int Sockets[2];
+    REQUIRE( ::socketpair(AF_UNIX, SOCK_STREAM, 0, Sockets) == 0 );
+
+    SECTION( "messages arrive as they were sent" ) {
+        const std::vector<std::string> Sent {"cpp_opencl", "", "-c", std::string("a\0b", 3), ""};
+        std::vector<std::string> Received {"left over"};
+        REQUIRE( compiler::protocol::WriteMessage(Sockets[0], Sent) );
+        REQUIRE( compiler::protocol::ReadMessage(Sockets[1], Received) );
+        REQUIRE( Received == Sent );
+    }
+
+    SECTION( "an empty list is a message" ) {
+        std::vector<std::string> Received {"left over"};
+        REQUIRE( compiler::protocol::WriteMessage(Sockets[0], {}) );
+        REQUIRE( compiler::protocol::WriteMessage(Sockets[0], {"0", "done"}) );
+        REQUIRE( compiler::protocol::ReadMessage(Sockets[1], Received) );
+        REQUIRE( Received.empty() );
+        REQUIRE( compiler::protocol::ReadMessage(Sockets[1], Received) );
+        REQUIRE( Received.size() == 2 );
+        REQUIRE( Received[1] == "done" );
+    }
+
+    SECTION( "a connection closed mid-message fails the read" ) {
+        uint32_t Count = 2;
+        REQUIRE( compiler::protocol::WriteAll(Sockets[0], &Count, sizeof(Count)) );
+        ::close(Sockets[0]);
+        Sockets[0] = -1;
+        std::vector<std::string> Received;
+        REQUIRE( !compiler::protocol::ReadMessage(Sockets[1], Received) );
+    }
+
+    if (Sockets[0] >= 0)
+        ::close(Sockets[0]);
+    ::close(Sockets[1]);
+}
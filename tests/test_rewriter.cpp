@@ -8,6 +8,9 @@
 #include <sstream>
 #include <stdexcept>
 
+#include <limits.h>
+#include <unistd.h>
+
 #define __CL_ENABLE_EXCEPTIONS
 #include "cl.h"
 
@@ -37,8 +40,26 @@ std::vector<std::string> TransformSource(std::string Source)
         "-I/usr/include",
         "-c", FileName
     };
-    auto Code = compiler::MainEntry(17, CmdLine, compiler::RewriteSourceFile);
+    std::vector<std::string> Code;
+    int Status = compiler::MainEntry(17, CmdLine, [&Code](clang::SmallVector<const char*, 256>& Args) {
+        Code = compiler::RewriteSourceFile(Args);
+        return 0;
+    });
+    REQUIRE( Status == 0 );
     assert(2 == Code.size());
+
+    // The OpenCL source is named by its absolute path, which the expected
+    // sources leave out
+    char WorkingDir[PATH_MAX];
+    REQUIRE( getcwd(WorkingDir, sizeof(WorkingDir)) != nullptr );
+    const std::string AbsoluteName = std::string(WorkingDir) + "/" + FileName + ".cl";
+    if (Code[0].find("cpp_opencl_embedded_source_registrar") != std::string::npos)
+        REQUIRE( Code[0].find(AbsoluteName) != std::string::npos );
+    for (std::string& Source : Code) {
+        std::string::size_type Pos;
+        while ((Pos = Source.find(AbsoluteName)) != std::string::npos)
+            Source.replace(Pos, AbsoluteName.size(), std::string(FileName) + ".cl");
+    }
     return Code;
 }
 
@@ -56,6 +77,23 @@ void CheckRewritenSource(std::string Cpu1, std::string Cpu2, std::string Gpu1, s
     REQUIRE( Gpu1 == Gpu2 );
 }
 
+/// The postfix of the kernel named by the rewritten lambda, e.g. _1804289383,
+/// which differs from run to run
+std::string GetKernelPostfix(const std::string& CpuSource) {
+    const std::string Prefix { "\"_Kernel" };
+    std::string::size_type Begin = CpuSource.find(Prefix);
+    REQUIRE( Begin != std::string::npos );
+    Begin += Prefix.size();
+    return CpuSource.substr(Begin, CpuSource.find('"', Begin) - Begin);
+}
+
+/// Is 'Part' in 'Source', ignoring whitespace ?
+bool ContainsCode(std::string Source, std::string Part) {
+    remove_whitespace(Source);
+    remove_whitespace(Part);
+    return Source.find(Part) != std::string::npos;
+}
+
 TEST_CASE( "opencl rewriter", "[rewriter]" ) {
 
     SECTION( "Add modifier to const member function" ) {
@@ -116,15 +154,20 @@ TEST_CASE( "opencl rewriter", "[rewriter]" ) {
             std::vector<int> MyArray {1,2,3,4,5,6};
             std::vector<int> Output(6);
 
-            compute::parallel_for_each(MyArray.begin(), MyArray.end(), Output.begin(), [](int x)  {
+            compute::parallel_for_each(MyArray.begin(), MyArray.end(), Output.begin(), compute::detail::WithHost([](int x)  {
               return std::pair<std::string,std::string> (  "Input.cpp.cl" , "_Kernel_1804289383" );
-            });
+            }, [](int x) {
+              return square(x);
+            }));
           }
 
           int main() {
             func();
             return 0;
           }
+
+          extern "C" const char cpp_opencl_embedded_source[];
+          static compute::detail::EmbeddedSource cpp_opencl_embedded_source_registrar ( "Input.cpp.cl" , cpp_opencl_embedded_source );
         )";
 
         const char* GpuCode = R"(
@@ -140,9 +183,555 @@ TEST_CASE( "opencl rewriter", "[rewriter]" ) {
 
           extern "C" long long get_global_id(int);
           extern "C" int get_global_size(int);
+          extern "C" long long get_local_id(int);
+          extern "C" int get_local_size(int);
+          extern "C" long long get_group_id(int);
+          extern "C" void barrier(int) __attribute__((noduplicate));
 
           int _Lambda_1804289383(int x) { return square(x); }
           extern "C" void _Kernel_1804289383(int* in, int* out) { unsigned idx = get_global_id(0); out[idx] = _Lambda_1804289383(in[idx]); }
+          extern "C" void _Kernel_1804289383_inplace(int* inout) { unsigned idx = get_global_id(0); inout[idx] = _Lambda_1804289383(inout[idx]); }
+        )";
+
+        auto Code = TransformSource(InputCode);
+        auto CpuSource = Code[0];
+        auto GpuSource = Code[1];
+
+        CheckRewritenSource(CpuSource, CpuCode, GpuSource, GpuCode);
+    }
+
+    SECTION( "parallel_for_each over several input ranges" ) {
+        const char* InputCode = R"(
+          #include <vector>
+          #include "ParallelForEach.h"
+
+          void func() {
+            std::vector<int> A {1,2,3,4,5,6};
+            std::vector<int> B {6,5,4,3,2,1};
+            std::vector<int> Output(6);
+
+            compute::parallel_for_each(A.begin(), A.end(), B.begin(), Output.begin(), [](int a, int b) {
+              return a * b;
+            });
+          }
+
+          int main() {
+            func();
+            return 0;
+          }
+        )";
+
+        const char* CpuCode = R"(
+          #include <vector>
+          #include "ParallelForEach.h"
+
+          void func() {
+            std::vector<int> A {1,2,3,4,5,6};
+            std::vector<int> B {6,5,4,3,2,1};
+            std::vector<int> Output(6);
+
+            compute::parallel_for_each(A.begin(), A.end(), B.begin(), Output.begin(), compute::detail::WithHost([](int a, int b)  {
+              return std::pair<std::string,std::string> (  "Input.cpp.cl" , "_Kernel_846930886" );
+            }, [](int a, int b) {
+              return a * b;
+            }));
+          }
+
+          int main() {
+            func();
+            return 0;
+          }
+
+          extern "C" const char cpp_opencl_embedded_source[];
+          static compute::detail::EmbeddedSource cpp_opencl_embedded_source_registrar ( "Input.cpp.cl" , cpp_opencl_embedded_source );
+        )";
+
+        const char* GpuCode = R"(
+          #include <vector>
+
+          void func() {
+            std::vector<int> A {1,2,3,4,5,6};
+            std::vector<int> B {6,5,4,3,2,1};
+            std::vector<int> Output(6);
+          }
+
+          extern "C" long long get_global_id(int);
+          extern "C" int get_global_size(int);
+          extern "C" long long get_local_id(int);
+          extern "C" int get_local_size(int);
+          extern "C" long long get_group_id(int);
+          extern "C" void barrier(int) __attribute__((noduplicate));
+
+          int _Lambda_846930886(int a, int b) { return a * b; }
+          extern "C" void _Kernel_846930886(int* in0, int* in1, int* out) { unsigned idx = get_global_id(0); out[idx] = _Lambda_846930886(in0[idx], in1[idx]); }
+        )";
+
+        auto Code = TransformSource(InputCode);
+        auto CpuSource = Code[0];
+        auto GpuSource = Code[1];
+
+        CheckRewritenSource(CpuSource, CpuCode, GpuSource, GpuCode);
+    }
+
+    SECTION( "parallel_for_each with a different output type" ) {
+        const char* InputCode = R"(
+          #include <vector>
+          #include "ParallelForEach.h"
+
+          void func() {
+            std::vector<float> In {1.5,2.5,3.5};
+            std::vector<int> Output(3);
+
+            compute::parallel_for_each(In.begin(), In.end(), Output.begin(), [](float x) {
+              return int(x);
+            });
+          }
+
+          int main() {
+            func();
+            return 0;
+          }
+        )";
+
+        const char* CpuCode = R"(
+          #include <vector>
+          #include "ParallelForEach.h"
+
+          void func() {
+            std::vector<float> In {1.5,2.5,3.5};
+            std::vector<int> Output(3);
+
+            compute::parallel_for_each(In.begin(), In.end(), Output.begin(), compute::detail::WithHost([](float x)  {
+              return std::pair<std::string,std::string> (  "Input.cpp.cl" , "_Kernel_1681692777" );
+            }, [](float x) {
+              return int(x);
+            }));
+          }
+
+          int main() {
+            func();
+            return 0;
+          }
+
+          extern "C" const char cpp_opencl_embedded_source[];
+          static compute::detail::EmbeddedSource cpp_opencl_embedded_source_registrar ( "Input.cpp.cl" , cpp_opencl_embedded_source );
+        )";
+
+        const char* GpuCode = R"(
+          #include <vector>
+
+          void func() {
+            std::vector<float> In {1.5,2.5,3.5};
+            std::vector<int> Output(3);
+          }
+
+          extern "C" long long get_global_id(int);
+          extern "C" int get_global_size(int);
+          extern "C" long long get_local_id(int);
+          extern "C" int get_local_size(int);
+          extern "C" long long get_group_id(int);
+          extern "C" void barrier(int) __attribute__((noduplicate));
+
+          int _Lambda_1681692777(float x) { return int(x); }
+          extern "C" void _Kernel_1681692777(float* in, int* out) { unsigned idx = get_global_id(0); out[idx] = _Lambda_1681692777(in[idx]); }
+        )";
+
+        auto Code = TransformSource(InputCode);
+        auto CpuSource = Code[0];
+        auto GpuSource = Code[1];
+
+        CheckRewritenSource(CpuSource, CpuCode, GpuSource, GpuCode);
+    }
+
+    SECTION( "parallel_for_each with lambda captures" ) {
+        const char* InputCode = R"(
+          #include <vector>
+          #include "ParallelForEach.h"
+
+          void func() {
+            std::vector<int> In {0,1,2};
+            std::vector<float> Table {1.5,2.5,3.5};
+            std::vector<float> Output(3);
+            float Scale = 2;
+
+            compute::parallel_for_each(In.begin(), In.end(), Output.begin(), [Scale, &Table](int x) {
+              return Table[x] * Scale;
+            });
+          }
+
+          int main() {
+            func();
+            return 0;
+          }
+        )";
+
+        const char* CpuCode = R"(
+          #include <vector>
+          #include "ParallelForEach.h"
+
+          void func() {
+            std::vector<int> In {0,1,2};
+            std::vector<float> Table {1.5,2.5,3.5};
+            std::vector<float> Output(3);
+            float Scale = 2;
+
+            compute::parallel_for_each(In.begin(), In.end(), Output.begin(), compute::detail::WithHost([Scale, &Table](int x)  {
+              return std::make_tuple( std::string( "Input.cpp.cl" ), std::string( "_Kernel_1714636915" ),
+                                      compute::detail::Capture(Scale), compute::detail::Capture(Table));
+            }, [Scale, &Table](int x) {
+              return Table[x] * Scale;
+            }));
+          }
+
+          int main() {
+            func();
+            return 0;
+          }
+
+          extern "C" const char cpp_opencl_embedded_source[];
+          static compute::detail::EmbeddedSource cpp_opencl_embedded_source_registrar ( "Input.cpp.cl" , cpp_opencl_embedded_source );
+        )";
+
+        const char* GpuCode = R"(
+          #include <vector>
+
+          void func() {
+            std::vector<int> In {0,1,2};
+            std::vector<float> Table {1.5,2.5,3.5};
+            std::vector<float> Output(3);
+            float Scale = 2;
+          }
+
+          extern "C" long long get_global_id(int);
+          extern "C" int get_global_size(int);
+          extern "C" long long get_local_id(int);
+          extern "C" int get_local_size(int);
+          extern "C" long long get_group_id(int);
+          extern "C" void barrier(int) __attribute__((noduplicate));
+
+          float _Lambda_1714636915(int x, float Scale, float* Table) { return Table[x] * Scale; }
+          extern "C" void _Kernel_1714636915(int* in, float* out, float Scale, float* Table) { unsigned idx = get_global_id(0); out[idx] = _Lambda_1714636915(in[idx], Scale, Table); }
+        )";
+
+        auto Code = TransformSource(InputCode);
+        auto CpuSource = Code[0];
+        auto GpuSource = Code[1];
+
+        CheckRewritenSource(CpuSource, CpuCode, GpuSource, GpuCode);
+    }
+
+    SECTION( "reduce" ) {
+        const char* InputCode = R"(
+          #include <vector>
+          #include "ParallelForEach.h"
+
+          void func() {
+            std::vector<int> In {1,2,3,4,5,6};
+
+            compute::reduce(In.begin(), In.end(), 0, [](int a, int b) {
+              return a + b;
+            });
+          }
+
+          int main() {
+            func();
+            return 0;
+          }
+        )";
+
+        const char* CpuCode = R"(
+          #include <vector>
+          #include "ParallelForEach.h"
+
+          void func() {
+            std::vector<int> In {1,2,3,4,5,6};
+
+            compute::reduce(In.begin(), In.end(), 0, [](int a, int b)  {
+              return std::pair<std::string,std::string> (  "Input.cpp.cl" , "_Kernel_1957747793" );
+            });
+          }
+
+          int main() {
+            func();
+            return 0;
+          }
+
+          extern "C" const char cpp_opencl_embedded_source[];
+          static compute::detail::EmbeddedSource cpp_opencl_embedded_source_registrar ( "Input.cpp.cl" , cpp_opencl_embedded_source );
+        )";
+
+        const char* GpuCode = R"(
+          #include <vector>
+
+          void func() {
+            std::vector<int> In {1,2,3,4,5,6};
+          }
+
+          extern "C" long long get_global_id(int);
+          extern "C" int get_global_size(int);
+          extern "C" long long get_local_id(int);
+          extern "C" int get_local_size(int);
+          extern "C" long long get_group_id(int);
+          extern "C" void barrier(int) __attribute__((noduplicate));
+
+          int _Lambda_1957747793(int a, int b) { return a + b; }
+          extern "C" void _Kernel_1957747793(int* in, int* out, __attribute__((address_space(3))) int* scratch, unsigned n) {
+            unsigned lid = get_local_id(0); unsigned size = get_local_size(0); unsigned group = get_group_id(0);
+            unsigned first = group * size; unsigned count = n - first < size ? n - first : size;
+            if (lid < count) scratch[lid] = in[first + lid];
+            barrier(1);
+            for (unsigned s = size / 2; s > 0; s >>= 1) {
+              if (lid < s && lid + s < count) scratch[lid] = _Lambda_1957747793(scratch[lid], scratch[lid + s]);
+              barrier(1);
+            }
+            if (lid == 0) out[group] = scratch[0];
+          }
+        )";
+
+        auto Code = TransformSource(InputCode);
+        auto CpuSource = Code[0];
+        auto GpuSource = Code[1];
+
+        CheckRewritenSource(CpuSource, CpuCode, GpuSource, GpuCode);
+    }
+
+    SECTION( "inclusive_scan" ) {
+        const char* InputCode = R"(
+          #include <vector>
+          #include "ParallelForEach.h"
+
+          void func() {
+            std::vector<int> In {1,2,3,4,5,6};
+            std::vector<int> Output(6);
+
+            compute::inclusive_scan(In.begin(), In.end(), Output.begin(), [](int a, int b) {
+              return a + b;
+            });
+          }
+
+          int main() {
+            func();
+            return 0;
+          }
+        )";
+
+        const char* CpuCode = R"(
+          #include <vector>
+          #include "ParallelForEach.h"
+
+          void func() {
+            std::vector<int> In {1,2,3,4,5,6};
+            std::vector<int> Output(6);
+
+            compute::inclusive_scan(In.begin(), In.end(), Output.begin(), [](int a, int b)  {
+              return std::pair<std::string,std::string> (  "Input.cpp.cl" , "_Kernel_424238335" );
+            });
+          }
+
+          int main() {
+            func();
+            return 0;
+          }
+
+          extern "C" const char cpp_opencl_embedded_source[];
+          static compute::detail::EmbeddedSource cpp_opencl_embedded_source_registrar ( "Input.cpp.cl" , cpp_opencl_embedded_source );
+        )";
+
+        const char* GpuCode = R"(
+          #include <vector>
+
+          void func() {
+            std::vector<int> In {1,2,3,4,5,6};
+            std::vector<int> Output(6);
+          }
+
+          extern "C" long long get_global_id(int);
+          extern "C" int get_global_size(int);
+          extern "C" long long get_local_id(int);
+          extern "C" int get_local_size(int);
+          extern "C" long long get_group_id(int);
+          extern "C" void barrier(int) __attribute__((noduplicate));
+
+          int _Lambda_424238335(int a, int b) { return a + b; }
+          extern "C" void _Kernel_424238335(int* data, int* sums, __attribute__((address_space(3))) int* scratch, unsigned n) {
+            unsigned lid = get_local_id(0); unsigned size = get_local_size(0); unsigned group = get_group_id(0);
+            unsigned block = 2 * size; unsigned first = group * block;
+            unsigned count = n - first < block ? n - first : block;
+            if (lid < count) scratch[lid] = data[first + lid];
+            if (lid + size < count) scratch[lid + size] = data[first + lid + size];
+            for (unsigned stride = 1; stride < block; stride *= 2) {
+              barrier(1); unsigned i = (lid + 1) * stride * 2 - 1;
+              if (i < count) scratch[i] = _Lambda_424238335(scratch[i - stride], scratch[i]);
+            }
+            for (unsigned stride = block / 4; stride > 0; stride /= 2) {
+              barrier(1); unsigned i = (lid + 1) * stride * 2 - 1;
+              if (i + stride < count) scratch[i + stride] = _Lambda_424238335(scratch[i], scratch[i + stride]);
+            }
+            barrier(1);
+            if (lid < count) data[first + lid] = scratch[lid];
+            if (lid + size < count) data[first + lid + size] = scratch[lid + size];
+            if (lid == 0) sums[group] = scratch[count - 1];
+          }
+          extern "C" void _Kernel_424238335_propagate(int* data, int* sums, unsigned n) {
+            unsigned lid = get_local_id(0); unsigned size = get_local_size(0); unsigned group = get_group_id(0);
+            unsigned first = group * 2 * size;
+            if (group == 0) return;
+            if (first + lid < n) data[first + lid] = _Lambda_424238335(sums[group - 1], data[first + lid]);
+            if (first + lid + size < n) data[first + lid + size] = _Lambda_424238335(sums[group - 1], data[first + lid + size]);
+          }
+        )";
+
+        auto Code = TransformSource(InputCode);
+        auto CpuSource = Code[0];
+        auto GpuSource = Code[1];
+
+        CheckRewritenSource(CpuSource, CpuCode, GpuSource, GpuCode);
+    }
+
+    SECTION( "parallel_for" ) {
+        const char* InputCode = R"(
+          #include <vector>
+          #include "ParallelForEach.h"
+
+          void func() {
+            std::vector<int> Output(12);
+
+            compute::parallel_for(compute::extent<2>{3, 4}, Output.begin(), [](compute::index<2> idx) {
+              return int(idx[0] * idx[1]);
+            });
+          }
+
+          int main() {
+            func();
+            return 0;
+          }
+        )";
+
+        const char* CpuCode = R"(
+          #include <vector>
+          #include "ParallelForEach.h"
+
+          void func() {
+            std::vector<int> Output(12);
+
+            compute::parallel_for(compute::extent<2>{3, 4}, Output.begin(), [](compute::index<2> idx)  {
+              return std::pair<std::string,std::string> (  "Input.cpp.cl" , "_Kernel_719885386" );
+            });
+          }
+
+          int main() {
+            func();
+            return 0;
+          }
+
+          extern "C" const char cpp_opencl_embedded_source[];
+          static compute::detail::EmbeddedSource cpp_opencl_embedded_source_registrar ( "Input.cpp.cl" , cpp_opencl_embedded_source );
+        )";
+
+        const char* GpuCode = R"(
+          #include <vector>
+
+          void func() {
+            std::vector<int> Output(12);
+          }
+
+          extern "C" long long get_global_id(int);
+          extern "C" int get_global_size(int);
+          extern "C" long long get_local_id(int);
+          extern "C" int get_local_size(int);
+          extern "C" long long get_group_id(int);
+          extern "C" void barrier(int) __attribute__((noduplicate));
+
+          namespace compute { template <int N> struct index { long long Values[N]; long long operator[](int I) const { return Values[I]; } }; }
+
+          int _Lambda_719885386(compute::index<2> idx) { return int(idx[0] * idx[1]); }
+          extern "C" void _Kernel_719885386(int* out) {
+            compute::index<2> idx; idx.Values[0] = get_global_id(1); idx.Values[1] = get_global_id(0);
+            unsigned long long linear = idx.Values[0]; linear = linear * get_global_size(0) + idx.Values[1];
+            out[linear] = _Lambda_719885386(idx);
+          }
+        )";
+
+        auto Code = TransformSource(InputCode);
+        auto CpuSource = Code[0];
+        auto GpuSource = Code[1];
+
+        CheckRewritenSource(CpuSource, CpuCode, GpuSource, GpuCode);
+    }
+
+    SECTION( "pipeline" ) {
+        const char* InputCode = R"(
+          #include <vector>
+          #include "ParallelForEach.h"
+
+          void func() {
+            std::vector<int> In {1,2,3,4,5,6};
+            std::vector<float> Output(6);
+            float Scale = 0.5;
+
+            compute::pipeline(In.begin(), In.end())
+              | compute::map([](int x) { return x * x; })
+              | compute::map([Scale](int x) { return x * Scale; })
+              | compute::into(Output.begin());
+          }
+
+          int main() {
+            func();
+            return 0;
+          }
+        )";
+
+        const char* CpuCode = R"(
+          #include <vector>
+          #include "ParallelForEach.h"
+
+          void func() {
+            std::vector<int> In {1,2,3,4,5,6};
+            std::vector<float> Output(6);
+            float Scale = 0.5;
+
+            compute::pipeline(In.begin(), In.end())
+              | compute::map(compute::detail::WithHost([](int x)  {
+                  return std::pair<std::string,std::string> (  "Input.cpp.cl" , "_Kernel_1649760492" );
+                }, [](int x) { return x * x; }))
+              | compute::map(compute::detail::WithHost([Scale](int x)  {
+                  return std::make_tuple( std::string( "Input.cpp.cl" ), std::string( "_Kernel_596516649" ),
+                                          compute::detail::Capture(Scale));
+                }, [Scale](int x) { return x * Scale; }))
+              | compute::into(Output.begin());
+          }
+
+          int main() {
+            func();
+            return 0;
+          }
+
+          extern "C" const char cpp_opencl_embedded_source[];
+          static compute::detail::EmbeddedSource cpp_opencl_embedded_source_registrar ( "Input.cpp.cl" , cpp_opencl_embedded_source );
+        )";
+
+        const char* GpuCode = R"(
+          #include <vector>
+
+          void func() {
+            std::vector<int> In {1,2,3,4,5,6};
+            std::vector<float> Output(6);
+            float Scale = 0.5;
+          }
+
+          extern "C" long long get_global_id(int);
+          extern "C" int get_global_size(int);
+          extern "C" long long get_local_id(int);
+          extern "C" int get_local_size(int);
+          extern "C" long long get_group_id(int);
+          extern "C" void barrier(int) __attribute__((noduplicate));
+
+          int _Lambda_1649760492(int x) { return x * x; }
+          float _Lambda_596516649(int x, float Scale) { return x * Scale; }
+          extern "C" void _Kernel_1649760492_596516649(int* in, float* out, float Scale_1) {
+            unsigned idx = get_global_id(0);
+            out[idx] = _Lambda_596516649(_Lambda_1649760492(in[idx]), Scale_1);
+          }
         )";
 
         auto Code = TransformSource(InputCode);
@@ -189,3 +778,122 @@ TEST_CASE( "opencl rewriter", "[rewriter]" ) {
 }
 
 
+TEST_CASE( "in-place kernels", "[rewriter]" ) {
+
+    SECTION( "a lambda returning its parameter type gets an in-place kernel" ) {
+        auto Code = TransformSource(R"(
+          #include <vector>
+          #include "ParallelForEach.h"
+
+          void func() {
+            std::vector<float> InOut {1,2,3};
+            compute::parallel_for_each(InOut.begin(), InOut.end(), InOut.begin(), [](float x) {
+              return x * 2.0f;
+            });
+          }
+        )");
+        std::string N = GetKernelPostfix(Code[0]);
+
+        REQUIRE( ContainsCode(Code[1], "extern \"C\" void _Kernel" + N + "(float* in, float* out)") );
+        REQUIRE( ContainsCode(Code[1], "extern \"C\" void _Kernel" + N + "_inplace(float* inout) "
+                              "{ unsigned idx = get_global_id(0); inout[idx] = _Lambda" + N + "(inout[idx]); }") );
+    }
+
+    SECTION( "a lambda returning another type gets none" ) {
+        auto Code = TransformSource(R"(
+          #include <vector>
+          #include "ParallelForEach.h"
+
+          void func() {
+            std::vector<int> In {1,2,3};
+            std::vector<float> Out(3);
+            compute::parallel_for_each(In.begin(), In.end(), Out.begin(), [](int x) {
+              return x * 0.5f;
+            });
+          }
+        )");
+        std::string N = GetKernelPostfix(Code[0]);
+
+        REQUIRE( ContainsCode(Code[1], "extern \"C\" void _Kernel" + N + "(int* in, float* out)") );
+        REQUIRE( !ContainsCode(Code[1], "_inplace") );
+    }
+}
+
+
+TEST_CASE( "reduction kernels", "[rewriter]" ) {
+
+    auto Code = TransformSource(R"(
+      #include <vector>
+      #include "ParallelForEach.h"
+
+      void func() {
+        std::vector<float> In {1,2,3};
+        compute::reduce(In.begin(), In.end(), 0.0f, [](float a, float b) {
+          return a > b ? a : b;
+        });
+      }
+    )");
+    std::string N = GetKernelPostfix(Code[0]);
+
+    REQUIRE( ContainsCode(Code[1], "float _Lambda" + N + "(float a, float b) { return a > b ? a : b; }") );
+    REQUIRE( ContainsCode(Code[1], "extern \"C\" void _Kernel" + N + "(float* in, float* out, "
+                          "__attribute__((address_space(3))) float* scratch, unsigned n)") );
+    REQUIRE( ContainsCode(Code[1], "scratch[lid] = _Lambda" + N + "(scratch[lid], scratch[lid + s]);") );
+    REQUIRE( ContainsCode(Code[1], "if (lid == 0) out[group] = scratch[0];") );
+    REQUIRE( !ContainsCode(Code[1], "_inplace") );
+}
+
+
+TEST_CASE( "scan kernels", "[rewriter]" ) {
+
+    auto Code = TransformSource(R"(
+      #include <vector>
+      #include "ParallelForEach.h"
+
+      void func() {
+        std::vector<int> In {1,2,3};
+        std::vector<int> Out(3);
+        int Bias = 1;
+        compute::exclusive_scan(In.begin(), In.end(), Out.begin(), 0, [Bias](int a, int b) {
+          return a + b + Bias;
+        });
+      }
+    )");
+    std::string N = GetKernelPostfix(Code[0]);
+
+    // The captures follow the other parameters of both kernels
+    REQUIRE( ContainsCode(Code[1], "extern \"C\" void _Kernel" + N + "(int* data, int* sums, "
+                          "__attribute__((address_space(3))) int* scratch, unsigned n, int Bias)") );
+    REQUIRE( ContainsCode(Code[1], "scratch[i] = _Lambda" + N + "(scratch[i - stride], scratch[i], Bias);") );
+    REQUIRE( ContainsCode(Code[1], "if (lid == 0) sums[group] = scratch[count - 1];") );
+    REQUIRE( ContainsCode(Code[1], "extern \"C\" void _Kernel" + N + "_propagate(int* data, int* sums, unsigned n, int Bias)") );
+    REQUIRE( ContainsCode(Code[1], "data[first + lid] = _Lambda" + N + "(sums[group - 1], data[first + lid], Bias);") );
+}
+
+
+TEST_CASE( "index kernels", "[rewriter]" ) {
+
+    auto Code = TransformSource(R"(
+      #include <vector>
+      #include "ParallelForEach.h"
+
+      void func() {
+        std::vector<float> Out(24);
+        compute::parallel_for(compute::extent<3>{2, 3, 4}, Out.begin(), [](compute::index<3> idx) {
+          return float(idx[2]);
+        });
+      }
+    )");
+    std::string N = GetKernelPostfix(Code[0]);
+
+    // The last dimension varies fastest, as NDRange dimension 0
+    REQUIRE( ContainsCode(Code[1], "extern \"C\" void _Kernel" + N + "(float* out)") );
+    REQUIRE( ContainsCode(Code[1], "idx.Values[0] = get_global_id(2); idx.Values[1] = get_global_id(1); "
+                          "idx.Values[2] = get_global_id(0);") );
+    REQUIRE( ContainsCode(Code[1], "unsigned long long linear = idx.Values[0]; "
+                          "linear = linear * get_global_size(1) + idx.Values[1]; "
+                          "linear = linear * get_global_size(0) + idx.Values[2];") );
+    REQUIRE( ContainsCode(Code[1], "out[linear] = _Lambda" + N + "(idx);") );
+}
+
+